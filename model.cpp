@@ -1,14 +1,37 @@
-#include <omp.h>
+#include <fcntl.h>
+#include <sched.h>
 #include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <cmath>
+#include <cstring>
+#include <deque>
 #include <exception>
 #include <format>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <set>
+#include <span>
+#include <thread>
 #include <vector>
 
+// GCC 12 reports spurious uninitialized values in AVX-512 intrinsics (GCC bug 105593)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#include <immintrin.h>
+#pragma GCC diagnostic pop
+
 #define JSON_USE_IMPLICIT_CONVERSIONS 0
 #include <json.hpp>
 
@@ -31,16 +54,104 @@ float bf16_to_float(bf16 value) {
     return u.f;
 }
 
+// Round to nearest even (NaN not preserved)
+bf16 float_to_bf16(float value) {
+    union {
+        float f;
+        uint32_t i;
+    } u;
+    u.f = value;
+    return static_cast<bf16>((u.i + 0x7fff + ((u.i >> 16) & 1)) >> 16);
+}
+
+enum class DType { BF16, I8, Q4 };
+
+// KV cache storage: fp32, or int8 with a scale per (position, KV head)
+enum class KVDType { F32, I8 };
+
+// Q4 packs each block of 32 values into 16 bytes, with value i in the low nibble of byte i and
+// value i + 16 in the high nibble, so that SIMD code unpacks a block with a mask & a shift
+constexpr unsigned Q4Block = 32;
+
 struct Parameter {
     const void* data;
+    DType dtype = DType::BF16;
+    const float* scale = nullptr;   // I8: per output channel (row), Q4: per group
+    const float* offset = nullptr;  // Q4: per group, w = scale * q + offset (default -8 * scale)
+    unsigned groupSize = 0;         // Q4: multiple of Q4Block, dividing each row
     const bf16* get_bf16() const { return reinterpret_cast<const bf16*>(data); }
+    const int8_t* get_i8() const { return reinterpret_cast<const int8_t*>(data); }
+    const uint8_t* get_q4() const { return reinterpret_cast<const uint8_t*>(data); }
+};
+
+// Alignment of all buffers: a cache line, and a multiple of every SIMD width
+constexpr size_t BufferAlign = 64;
+// Buffers of at least this size are mapped directly, and backed by huge pages where possible
+constexpr size_t HugePageSize = size_t(2) << 20;
+
+enum class Backing { Heap, TransparentHugePages, HugeTLB };
+
+// Bytes currently allocated by allocate(), for each Backing (atomic, as pool workers allocate)
+std::atomic<size_t> allocatedBytes[3] = {0, 0, 0};
+
+struct Deallocate {
+    size_t bytes = 0;
+    size_t mapped = 0;  // length of the mapping, if not on the heap
+    Backing backing = Backing::Heap;
+
+    void operator()(void* p) const {
+        allocatedBytes[static_cast<int>(backing)].fetch_sub(bytes, std::memory_order_relaxed);
+        if (mapped) {
+            munmap(p, mapped);
+        } else {
+            std::free(p);
+        }
+    }
 };
 
+template <class T>
+using Buffer = std::unique_ptr<T[], Deallocate>;
+
+// Uninitialized memory for `n` elements, aligned to BufferAlign. Large buffers are mapped in whole
+// huge pages: explicit (MAP_HUGETLB) if the system has reserved any, otherwise transparent
+// (madvise MADV_HUGEPAGE, aligned so that every 2 MiB range can be backed by one huge page)
+template <class T>
+Buffer<T> allocate(size_t n) {
+    Deallocate info{n * sizeof(T)};
+    void* p = nullptr;
+    if (info.bytes < HugePageSize) {
+        p = std::aligned_alloc(BufferAlign,
+                               std::max<size_t>(1, (info.bytes + BufferAlign - 1) / BufferAlign) *
+                                   BufferAlign);
+        if (!p) throw std::bad_alloc();
+    } else {
+        info.mapped = (info.bytes + HugePageSize - 1) / HugePageSize * HugePageSize;
+        info.backing = Backing::HugeTLB;
+        p = mmap(nullptr, info.mapped, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p == MAP_FAILED) {
+            // Over-allocate by one huge page, then trim to an aligned range
+            info.backing = Backing::TransparentHugePages;
+            p = mmap(nullptr, info.mapped + HugePageSize, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) throw std::bad_alloc();
+            auto begin = reinterpret_cast<uintptr_t>(p);
+            auto aligned = (begin + HugePageSize - 1) / HugePageSize * HugePageSize;
+            if (aligned > begin) munmap(p, aligned - begin);
+            munmap(reinterpret_cast<void*>(aligned + info.mapped), begin + HugePageSize - aligned);
+            p = reinterpret_cast<void*>(aligned);
+            madvise(p, info.mapped, MADV_HUGEPAGE);
+        }
+    }
+    allocatedBytes[static_cast<int>(info.backing)].fetch_add(info.bytes, std::memory_order_relaxed);
+    return Buffer<T>(static_cast<T*>(p), info);
+}
+
 struct Activation {
     size_t size;
-    std::unique_ptr<float[]> data;
-    explicit Activation(size_t n) : size(n), data(new float[n]) {}
-    Activation(float* begin, float* end) : size(end - begin), data(new float[end - begin]) {
+    Buffer<float> data;
+    explicit Activation(size_t n) : size(n), data(allocate<float>(n)) {}
+    Activation(float* begin, float* end) : size(end - begin), data(allocate<float>(end - begin)) {
         std::copy(begin, end, data.get());
     }
 };
@@ -67,6 +178,62 @@ std::ostream& operator<<(std::ostream& out, const Activation& a) {
     return out;
 }
 
+// Read-only, shared mapping of a whole file
+struct MappedFile {
+    const char* data;
+    size_t size;
+
+    explicit MappedFile(const std::string& path) {
+        auto fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error(std::format("Can't open {}: {}", path, std::strerror(errno)));
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            close(fd);
+            throw std::runtime_error(std::format("Can't stat {}: {}", path, std::strerror(errno)));
+        }
+        size = info.st_size;
+        auto ptr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (ptr == MAP_FAILED) {
+            throw std::runtime_error(std::format("Can't mmap {}: {}", path, std::strerror(errno)));
+        }
+        // Only takes effect if the kernel supports huge pages for read-only file mappings
+        madvise(ptr, size, MADV_HUGEPAGE);
+        data = static_cast<const char*>(ptr);
+    }
+    ~MappedFile() { munmap(const_cast<char*>(data), size); }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+};
+
+// Summary of memory from allocate(), and how much the kernel has actually backed with huge pages
+std::string memoryReport() {
+    constexpr double MiB = 1 << 20;
+    auto report = std::format(
+        "Allocated {:.0f} MiB: {:.0f} MiB hugetlb, {:.0f} MiB THP-advised, {:.0f} MiB heap",
+        (allocatedBytes[0] + allocatedBytes[1] + allocatedBytes[2]) / MiB,
+        allocatedBytes[static_cast<int>(Backing::HugeTLB)] / MiB,
+        allocatedBytes[static_cast<int>(Backing::TransparentHugePages)] / MiB,
+        allocatedBytes[static_cast<int>(Backing::Heap)] / MiB);
+    std::ifstream smaps("/proc/self/smaps_rollup");
+    std::string line;
+    std::vector<std::string> backed;
+    while (std::getline(smaps, line)) {
+        for (auto key : {"AnonHugePages:", "FilePmdMapped:", "Private_Hugetlb:"}) {
+            if (line.starts_with(key)) {
+                auto kB = std::stoul(line.substr(std::strlen(key)));
+                backed.push_back(std::format("{} {:.0f} MiB", key, kB * 1024 / MiB));
+            }
+        }
+    }
+    for (auto i = 0u; i < backed.size(); ++i) {
+        report += (i ? ", " : "; process ") + backed[i];
+    }
+    return report;
+}
+
 struct Stopwatch {
     typedef std::chrono::high_resolution_clock clock;
     clock::time_point start;
@@ -80,317 +247,3250 @@ struct Stopwatch {
 };
 
 ///////////////////////////////////////////////////////////////////////////////
-// Model
+// Threads
 
-struct Layer {
-    Parameter attnNorm;
-    Parameter attnQ;
-    Parameter attnK;
-    Parameter attnV;
-    Parameter attnO;
+// The `idx`th of `count` near-equal contiguous ranges of [0, n), with boundaries aligned to `align`
+std::pair<unsigned, unsigned> partition(unsigned n, unsigned align, unsigned idx, unsigned count) {
+    auto blocks = (n + align - 1) / align;
+    auto begin = std::min(n, (blocks * idx / count) * align);
+    auto end = std::min(n, (blocks * (idx + 1) / count) * align);
+    return {begin, end};
+}
 
-    Parameter mlpNorm;
-    Parameter mlpUp;
-    Parameter mlpGate;
-    Parameter mlpDown;
-};
+// Parse a sysfs list such as "0-3,8,10-11"
+std::vector<unsigned> parseIndexList(const std::string& text) {
+    std::vector<unsigned> indices;
+    std::istringstream in(text);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        if (item.empty()) continue;
+        auto dash = item.find('-');
+        auto first = std::stoul(item.substr(0, dash));
+        auto last = dash == std::string::npos ? first : std::stoul(item.substr(dash + 1));
+        for (auto i = first; i <= last; ++i) indices.push_back(i);
+    }
+    return indices;
+}
 
-struct Model {
-    unsigned nLayers;
-    unsigned dVocab;
-    unsigned dModel;
-    unsigned dFFN;
-    unsigned dAttnHead;
-    unsigned dAttnKV;
-    unsigned dAttnQ;
-    std::vector<float> ropeFreq;
-    float normEps;
+// CPUs of each online NUMA node, from sysfs (or a single node of all CPUs, if unavailable)
+std::vector<std::vector<unsigned>> numaNodes() {
+    std::vector<std::vector<unsigned>> nodes;
+    std::string line;
+    std::ifstream online("/sys/devices/system/node/online");
+    if (std::getline(online, line)) {
+        for (auto node : parseIndexList(line)) {
+            std::ifstream cpus(std::format("/sys/devices/system/node/node{}/cpulist", node));
+            if (std::getline(cpus, line) && !parseIndexList(line).empty()) {
+                nodes.push_back(parseIndexList(line));
+            }
+        }
+    }
+    if (nodes.empty()) {
+        nodes.emplace_back(std::thread::hardware_concurrency());
+        std::iota(nodes[0].begin(), nodes[0].end(), 0u);
+    }
+    return nodes;
+}
 
-    Parameter embedTokens;
-    std::vector<Layer> layers;
-    Parameter finalNorm;
+// Restrict the calling thread to a single CPU
+void pinThread(unsigned cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        throw std::runtime_error(std::format("Can't pin to CPU {}: {}", cpu, std::strerror(errno)));
+    }
+}
 
-    std::vector<char> _parameterData;
+// Iterations to spin (with a pause) waiting for an atomic to change, before sleeping on a futex
+constexpr unsigned SpinIterations = 1 << 12;
 
-    Model() = default;
-    Model(const Model&) = delete;
-    Model(Model&&) = default;
-    Model& operator=(const Model&) = delete;
-    Model& operator=(Model&&) = default;
-};
+template <class T>
+void spinWait(const std::atomic<T>& value, T old) {
+    for (auto i = 0u; i < SpinIterations; ++i) {
+        if (value.load(std::memory_order_acquire) != old) return;
+        _mm_pause();
+    }
+    while (value.load(std::memory_order_acquire) == old) {
+        value.wait(old, std::memory_order_acquire);
+    }
+}
 
-Model loadConfig(std::istream& file) {
-    auto config = json::parse(file);
+// Persistent workers, so that dispatching each op costs an atomic increment rather than a thread
+// fork & join. Between jobs, workers spin briefly (catching the next op of a forward pass), then
+// sleep. run() calls fn(idx, count) on every thread, where the calling thread is idx 0
+// If `cpus` is given, thread idx is pinned to cpus[idx] (including the calling thread)
+struct ThreadPool {
+    std::vector<std::thread> workers;
+    std::atomic<unsigned> generation{0};  // incremented to start each job
+    std::atomic<unsigned> pending{0};     // workers yet to finish the current job
+    std::atomic<bool> stop{false};        // set before the final generation increment
+    void (*call)(void* fn, unsigned idx, unsigned count) = nullptr;
+    void* fn = nullptr;
 
-    Model m;
-    m.nLayers = config["num_hidden_layers"].template get<unsigned>();
-    m.dVocab = config["vocab_size"].template get<unsigned>();
-    m.dModel = config["hidden_size"].template get<unsigned>();
-    m.dFFN = config["intermediate_size"].template get<unsigned>();
-    m.dAttnHead = config["head_dim"].template get<unsigned>();
-    m.dAttnKV = config["num_key_value_heads"].template get<unsigned>();
-    m.dAttnQ = config["num_attention_heads"].template get<unsigned>() / m.dAttnKV;
-    m.normEps = config["rms_norm_eps"].template get<float>();
+    static thread_local bool inJob;  // nested run() calls execute serially
 
-    auto theta = config["rope_theta"].template get<float>();
-    auto scaling = config["rope_scaling"];
-    auto factor = scaling["factor"].template get<float>();
-    auto lowFreqFactor = scaling["low_freq_factor"].template get<float>();
-    auto highFreqFactor = scaling["high_freq_factor"].template get<float>();
-    auto originalLength = scaling["original_max_position_embeddings"].template get<unsigned>();
+    explicit ThreadPool(unsigned nThreads, const std::vector<unsigned>& cpus = {}) {
+        if (!cpus.empty()) pinThread(cpus[0]);
+        for (auto idx = 1u; idx < nThreads; ++idx) {
+            workers.emplace_back([this, idx, cpu = cpus.empty() ? -1 : int(cpus[idx])] {
+                if (cpu >= 0) pinThread(cpu);
+                work(idx);
+            });
+        }
+    }
 
-    for (auto i = 0u; i < m.dAttnHead; i += 2) {
-        auto freq = std::pow(theta, -static_cast<float>(i) / m.dAttnHead);
-        auto z = (originalLength * freq / (2 * static_cast<float>(M_PI)) - lowFreqFactor) /
-                 (highFreqFactor - lowFreqFactor);
-        z = std::clamp(z, 0.f, 1.f);
-        m.ropeFreq.push_back(freq * ((1 - z) / factor + z));
+    ~ThreadPool() {
+        stop.store(true, std::memory_order_relaxed);
+        generation.fetch_add(1, std::memory_order_release);
+        generation.notify_all();
+        for (auto& worker : workers) worker.join();
     }
-    return m;
-}
 
-void loadParameters(Model& model, std::istream& file) {
-    uint64_t nHeader(0);
-    file.read(reinterpret_cast<char*>(&nHeader), sizeof(nHeader));
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
 
-    // Read the JSON header
-    std::string headerData(nHeader, '\0');
-    file.read(headerData.data(), headerData.size());
-    auto header = json::parse(headerData);
-    header.erase("__metadata__");
-    uint64_t maxOffset(0);
-    for (auto e : header.items()) {
-        maxOffset = std::max(maxOffset, e.value()["data_offsets"][1].template get<uint64_t>());
+    unsigned size() const { return workers.size() + 1; }
+
+    template <class Fn>
+    void run(Fn&& job) {
+        if (workers.empty() || inJob) {
+            job(0u, 1u);
+            return;
+        }
+        fn = &job;
+        call = [](void* f, unsigned idx, unsigned count) {
+            (*static_cast<std::remove_reference_t<Fn>*>(f))(idx, count);
+        };
+        pending.store(workers.size(), std::memory_order_relaxed);
+        generation.fetch_add(1, std::memory_order_release);
+        generation.notify_all();
+        inJob = true;
+        job(0u, size());
+        inJob = false;
+        for (auto remaining = pending.load(std::memory_order_acquire); remaining;
+             remaining = pending.load(std::memory_order_acquire)) {
+            spinWait(pending, remaining);
+        }
     }
 
-    // Read the data buffer, in chunks
-    std::vector<char> tensorData;
-    model._parameterData.reserve(maxOffset);
-    constexpr uint64_t chunkSize(1 << 16);
-    for (auto i = uint64_t(0); i < maxOffset; i += chunkSize) {
-        file.read(model._parameterData.data() + i, std::min(chunkSize, maxOffset - i));
+    void work(unsigned idx) {
+        inJob = true;
+        auto seen = 0u;
+        while (true) {
+            spinWait(generation, seen);
+            seen = generation.load(std::memory_order_acquire);
+            if (stop.load(std::memory_order_relaxed)) return;
+            call(fn, idx, size());
+            if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                pending.notify_one();
+            }
+        }
     }
+};
 
-    // Load the parameter pointers
-    auto load = [&model, &header](const std::string& name) -> Parameter {
-        auto j = header["model." + name + ".weight"];
-        if (j["dtype"].template get<std::string>() != "BF16") {
-            throw std::invalid_argument("Non-BF16 data");
+thread_local bool ThreadPool::inJob = false;
+
+std::unique_ptr<ThreadPool>& globalThreadPool() {
+    static std::unique_ptr<ThreadPool> pool;
+    return pool;
+}
+
+// Use `n` threads (including the caller) for all ops
+// If `numa`, threads are spread over NUMA nodes in contiguous runs of idx, each pinned to a CPU of
+// its node, so that a thread's static partition of work stays on one node (see placeProjections)
+void setThreads(unsigned n, bool numa = false) {
+    n = std::max(n, 1u);
+    std::vector<unsigned> cpus;
+    if (numa) {
+        auto nodes = numaNodes();
+        for (auto node = 0u; node < nodes.size(); ++node) {
+            auto [t0, t1] = partition(n, 1, node, nodes.size());
+            for (auto t = t0; t < t1; ++t) {
+                cpus.push_back(nodes[node][(t - t0) % nodes[node].size()]);
+            }
         }
-        auto start = j["data_offsets"][0].template get<uint64_t>();
-        return {model._parameterData.data() + start};
-    };
-    model.embedTokens = load("embed_tokens");
-    for (auto idx = 0u; idx < model.nLayers; ++idx) {
-        auto pre = std::format("layers.{}.", idx);
-        Layer layer;
-        layer.attnNorm = load(pre + "input_layernorm");
-        layer.attnQ = load(pre + "self_attn.q_proj");
-        layer.attnK = load(pre + "self_attn.k_proj");
-        layer.attnV = load(pre + "self_attn.v_proj");
-        layer.attnO = load(pre + "self_attn.o_proj");
-        layer.mlpNorm = load(pre + "post_attention_layernorm");
-        layer.mlpGate = load(pre + "mlp.gate_proj");
-        layer.mlpUp = load(pre + "mlp.up_proj");
-        layer.mlpDown = load(pre + "mlp.down_proj");
-        model.layers.push_back(layer);
     }
-    model.finalNorm = load("norm");
+    globalThreadPool().reset();
+    globalThreadPool() = std::make_unique<ThreadPool>(n, cpus);
+}
+
+// The pool used by all ops, by default one thread per CPU
+ThreadPool& threadPool() {
+    if (!globalThreadPool()) setThreads(std::thread::hardware_concurrency());
+    return *globalThreadPool();
+}
+
+// Call fn(i) for i in [0, n), split into contiguous ranges across the pool
+template <class Fn>
+void parallelFor(size_t n, Fn&& fn) {
+    threadPool().run([&](unsigned idx, unsigned count) {
+        for (auto i = n * idx / count; i < n * (idx + 1) / count; ++i) fn(i);
+    });
+}
+
+// Call fn(i) for i in [0, n), with threads taking the next i as they finish
+template <class Fn>
+void parallelForDynamic(unsigned n, Fn&& fn) {
+    std::atomic<unsigned> next{0};
+    threadPool().run([&](unsigned, unsigned) {
+        for (auto i = next.fetch_add(1, std::memory_order_relaxed); i < n;
+             i = next.fetch_add(1, std::memory_order_relaxed)) {
+            fn(i);
+        }
+    });
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Ops
+// Kernels
+//
+// Each instruction set gets a family of kernels, compiled for that target by function attribute
+// and selected at runtime from CPUID, so that a single binary runs well on any x86-64 host.
 
-Activation embeddingLookup(const std::vector<unsigned>& tokens,
-                           const bf16* weight,
-                           unsigned dModel) {
-    Activation y(tokens.size() * dModel);
-    for (auto n = 0u; n < tokens.size(); ++n) {
-        for (auto i = 0u; i < dModel; ++i) {
-            y.data[n * dModel + i] = bf16_to_float(weight[tokens[n] * dModel + i]);
+#define LP_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define LP_TARGET_AVX512F __attribute__((target("avx512f")))
+#define LP_TARGET_AVX512BF16 __attribute__((target("avx512f,avx512bf16")))
+
+// Matrix kernels compute a range of output channels [j0, j1) on the calling thread; callers
+// partition channels between threads
+struct Kernels {
+    std::string name;
+    // y[j - j0] = dot(x, w[j, :]) for j in [j0, j1)
+    void (*gemv)(const float* x,
+                 const Parameter& w,
+                 unsigned dIn,
+                 unsigned j0,
+                 unsigned j1,
+                 float* y);
+    // y[n * ldy + j - j0] = dot(x[n, :], w[j, :]) for n in [0, nRows), j in [j0, j1)
+    void (*gemm)(const float* x,
+                 unsigned nRows,
+                 const Parameter& w,
+                 unsigned dIn,
+                 unsigned j0,
+                 unsigned j1,
+                 float* y,
+                 unsigned ldy);
+    // y[t] = dot(x, w[t * ldw : t * ldw + n]) for t in [0, m)
+    void (*dotRows)(const float* x, const float* w, unsigned ldw, unsigned m, unsigned n, float* y);
+    // y += sum_t alpha[t] * w[t * ldw : t * ldw + n] for t in [0, m)
+    void (*axpyRows)(const float* alpha,
+                     const float* w,
+                     unsigned ldw,
+                     unsigned m,
+                     unsigned n,
+                     float* y);
+    // As dotRows & axpyRows, for int8 rows of w
+    void (*dotRowsI8)(const float* x,
+                      const int8_t* w,
+                      unsigned ldw,
+                      unsigned m,
+                      unsigned n,
+                      float* y);
+    void (*axpyRowsI8)(const float* alpha,
+                       const int8_t* w,
+                       unsigned ldw,
+                       unsigned m,
+                       unsigned n,
+                       float* y);
+    // Rotate pairs (x[i], x[i + n]) by angle a_i, given cos(a_i) & sin(a_i), for i in [0, n)
+    // (y may alias x)
+    void (*rotate)(const float* x, const float* cos, const float* sin, unsigned n, float* y);
+    // Optional (nullptr for fp32 activations): for bf16 weights, x is rounded to bf16 once per op
+    // by toBf16, then used by gemvBf16 & gemmBf16 (as gemv & gemm), so that every path has the same
+    // precision
+    void (*toBf16)(const float* x, unsigned n, bf16* y);
+    void (*gemvBf16)(const bf16* x,
+                     const Parameter& w,
+                     unsigned dIn,
+                     unsigned j0,
+                     unsigned j1,
+                     float* y);
+    void (*gemmBf16)(const bf16* x,
+                     unsigned nRows,
+                     const Parameter& w,
+                     unsigned dIn,
+                     unsigned j0,
+                     unsigned j1,
+                     float* y,
+                     unsigned ldy);
+};
+
+// dot(x, w) for Q4 row w, with one scale & offset per group
+using DotQ4Fn = float (*)(const float* x,
+                          const uint8_t* q,
+                          const float* scale,
+                          const float* offset,
+                          unsigned groupSize,
+                          unsigned n);
+
+template <float (*DotBf16)(const float*, const bf16*, unsigned),
+          float (*DotI8)(const float*, const int8_t*, unsigned),
+          DotQ4Fn DotQ4>
+void gemvRows(const float* x,
+              const Parameter& w,
+              unsigned dIn,
+              unsigned j0,
+              unsigned j1,
+              float* y) {
+    auto nGroups = w.groupSize ? dIn / w.groupSize : 0;
+    for (auto j = j0; j < j1; ++j) {
+        if (w.dtype == DType::Q4) {
+            y[j - j0] = DotQ4(x, w.get_q4() + j * dIn / 2, w.scale + j * nGroups,
+                              w.offset ? w.offset + j * nGroups : nullptr, w.groupSize, dIn);
+        } else if (w.dtype == DType::I8) {
+            y[j - j0] = w.scale[j] * DotI8(x, w.get_i8() + j * dIn, dIn);
+        } else {
+            y[j - j0] = DotBf16(x, w.get_bf16() + j * dIn, dIn);
         }
     }
-    return y;
 }
 
-Activation rmsNorm(const Activation& x, const bf16* weight, unsigned dModel, float eps) {
-    Activation y(x.size);
-    for (auto i0 = 0u; i0 < x.size; i0 += dModel) {
-        float sumSq = 0;
-        for (auto i = 0u; i < dModel; ++i) {
-            sumSq += x.data[i0 + i] * x.data[i0 + i];
+// Dequantize w[j, k0 : k0 + n]
+void unpackRow(const Parameter& w, unsigned dIn, unsigned j, unsigned k0, unsigned n, float* out) {
+    if (w.dtype == DType::Q4) {
+        auto nGroups = dIn / w.groupSize;
+        for (auto i = 0u; i < n; ++i) {
+            auto k = k0 + i;
+            auto g = j * nGroups + k / w.groupSize;
+            auto block = w.get_q4() + (j * dIn + k / Q4Block * Q4Block) / 2;
+            auto idx = k % Q4Block;
+            auto q = idx < Q4Block / 2 ? block[idx] & 0xF : block[idx - Q4Block / 2] >> 4;
+            out[i] = w.scale[g] * q + (w.offset ? w.offset[g] : -8 * w.scale[g]);
         }
-        float norm = 1 / (std::sqrt(sumSq / dModel + eps));
-        for (auto i = 0u; i < dModel; ++i) {
-            y.data[i0 + i] = x.data[i0 + i] * norm * bf16_to_float(weight[i]);
+    } else if (w.dtype == DType::I8) {
+        auto row = w.get_i8() + j * dIn + k0;
+        for (auto i = 0u; i < n; ++i) out[i] = w.scale[j] * row[i];
+    } else {
+        auto row = w.get_bf16() + j * dIn + k0;
+        for (auto i = 0u; i < n; ++i) out[i] = bf16_to_float(row[i]);
+    }
+}
+
+// Input block size for the blocked GEMM
+constexpr unsigned GemmKC = 256;
+
+// Unpack w[j0 + j, k0 + i] for j in [0, nj), i in [0, kc <= GemmKC) into panel[i * NR + j] as
+// fp32, with zeros for j in [nj, NR)
+void packPanel(const Parameter& w,
+               unsigned dIn,
+               unsigned j0,
+               unsigned nj,
+               unsigned k0,
+               unsigned kc,
+               unsigned NR,
+               float* panel) {
+    float row[GemmKC];
+    for (auto j = 0u; j < NR; ++j) {
+        if (j < nj) {
+            unpackRow(w, dIn, j0 + j, k0, kc, row);
+        } else {
+            std::fill(row, row + kc, 0.0f);
         }
+        for (auto i = 0u; i < kc; ++i) panel[i * NR + j] = row[i];
     }
-    return y;
 }
 
-Activation project(const Activation& x, const bf16* weight, unsigned dIn, unsigned dOut) {
-    Activation y(x.size / dIn * dOut);
-#pragma omp parallel for
-    for (auto j = 0u; j < dOut; ++j) {
-        for (auto n = 0u; n < x.size / dIn; ++n) {
-            float dot = 0;
-            for (auto i = 0u; i < dIn; ++i) {
-                dot += x.data[n * dIn + i] * bf16_to_float(weight[j * dIn + i]);
+// As packPanel(), for bf16 weights & activations (kc even), keeping bf16 and interleaving pairs of
+// inputs, panel[(i / 2 * NR + j) * 2 + i % 2], as VDPBF16PS multiplies pairs
+void packPanel(const Parameter& w,
+               unsigned dIn,
+               unsigned j0,
+               unsigned nj,
+               unsigned k0,
+               unsigned kc,
+               unsigned NR,
+               bf16* panel) {
+    for (auto j = 0u; j < NR; ++j) {
+        auto row = w.get_bf16() + size_t(j0 + j) * dIn + k0;
+        for (auto i = 0u; i < kc; ++i) {
+            panel[(i / 2 * NR + j) * 2 + i % 2] = j < nj ? row[i] : bf16(0);
+        }
+    }
+}
+
+// Micro-kernel tile for `Gemm`, dispatching a runtime row count to `Gemm::tile<Rows>`
+template <class Gemm, unsigned Rows = Gemm::MR, class T>
+void gemmTile(unsigned rows, const T* panel, const T* x, unsigned ldx, unsigned kc, float* c) {
+    if constexpr (Rows > 1) {
+        if (rows < Rows) return gemmTile<Gemm, Rows - 1>(rows, panel, x, ldx, kc, c);
+    }
+    Gemm::template tile<Rows>(panel, x, ldx, kc, c);
+}
+
+// Cache-blocked GEMM
+// For each panel of Gemm::NR output channels and block of KC inputs, packs the weights into fp32
+// transposed (shape (KC, NR), L1-resident), then sweeps all rows of x with a register-blocked
+// micro-kernel that broadcasts x and accumulates an (MR, NR) tile of y.
+// With bf16 x, the panel is also bf16 (see packPanel)
+template <class Gemm, class T>
+void gemmBlocked(const T* x,
+                 unsigned nRows,
+                 const Parameter& w,
+                 unsigned dIn,
+                 unsigned j0,
+                 unsigned j1,
+                 float* y,
+                 unsigned ldy) {
+    constexpr unsigned MR = Gemm::MR, NR = Gemm::NR, KC = GemmKC;
+    alignas(64) T panel[KC * NR];
+    float c[MR * NR];
+    for (auto jp = j0; jp < j1; jp += NR) {
+        auto nj = std::min(NR, j1 - jp);
+        auto yp = y + (jp - j0);
+        for (auto k0 = 0u; k0 < dIn; k0 += KC) {
+            auto kc = std::min(KC, dIn - k0);
+            packPanel(w, dIn, jp, nj, k0, kc, NR, panel);
+            for (auto n0 = 0u; n0 < nRows; n0 += MR) {
+                auto rows = std::min(MR, nRows - n0);
+                for (auto r = 0u; r < rows; ++r) {
+                    for (auto j = 0u; j < NR; ++j) {
+                        c[r * NR + j] = (k0 && j < nj) ? yp[(n0 + r) * ldy + j] : 0;
+                    }
+                }
+                gemmTile<Gemm>(rows, panel, x + n0 * dIn + k0, dIn, kc, c);
+                for (auto r = 0u; r < rows; ++r) {
+                    std::copy(c + r * NR, c + r * NR + nj, yp + (n0 + r) * ldy);
+                }
             }
-            y.data[n * dOut + j] = dot;
         }
     }
-    return y;
 }
 
-// x.shape (seq, nHeads, 2*len(freq))
-Activation rotate(const Activation& x, const std::vector<float>& freq, unsigned nHeads) {
-    Activation y(x.size);
-    unsigned headDim = 2 * freq.size();
-    for (auto n = 0u; n < x.size / (nHeads * headDim); ++n) {
-        for (auto h = 0u; h < nHeads; ++h) {
-            for (auto i = 0u; i < freq.size(); ++i) {
-                auto idxRe = n * nHeads * headDim + h * headDim + i;
-                auto idxIm = idxRe + freq.size();
-                auto cosA = std::cos(freq[i] * n);
-                auto sinA = std::sin(freq[i] * n);
-                y.data[idxRe] = cosA * x.data[idxRe] - sinA * x.data[idxIm];
-                y.data[idxIm] = cosA * x.data[idxIm] + sinA * x.data[idxRe];
+// Scalar
+
+float dotBf16Scalar(const float* x, const bf16* w, unsigned n) {
+    float sum = 0;
+    for (auto i = 0u; i < n; ++i) {
+        sum += x[i] * bf16_to_float(w[i]);
+    }
+    return sum;
+}
+
+float dotI8Scalar(const float* x, const int8_t* w, unsigned n) {
+    float sum = 0;
+    for (auto i = 0u; i < n; ++i) {
+        sum += x[i] * w[i];
+    }
+    return sum;
+}
+
+float dotQ4Scalar(const float* x,
+                  const uint8_t* q,
+                  const float* scale,
+                  const float* offset,
+                  unsigned groupSize,
+                  unsigned n) {
+    float sum = 0;
+    for (auto g = 0u; g < n / groupSize; ++g) {
+        auto off = offset ? offset[g] : -8 * scale[g];
+        for (auto b = g * groupSize; b < (g + 1) * groupSize; b += Q4Block) {
+            for (auto i = 0u; i < Q4Block / 2; ++i) {
+                auto packed = q[b / 2 + i];
+                sum += x[b + i] * (scale[g] * (packed & 0xF) + off);
+                sum += x[b + i + Q4Block / 2] * (scale[g] * (packed >> 4) + off);
             }
         }
     }
-    return y;
+    return sum;
 }
 
-void softmaxInPlace(Activation& x) {
-    auto max = *std::max_element(x.data.get(), x.data.get() + x.size);
+float dotScalar(const float* a, const float* b, unsigned n) {
     float sum = 0;
-    for (auto i = 0u; i < x.size; ++i) {
-        x.data[i] = std::exp(x.data[i] - max);
-        sum += x.data[i];
+    for (auto i = 0u; i < n; ++i) {
+        sum += a[i] * b[i];
     }
-    for (auto i = 0u; i < x.size; ++i) {
-        x.data[i] /= sum;
+    return sum;
+}
+
+void axpyScalar(float alpha, const float* x, float* y, unsigned n) {
+    for (auto i = 0u; i < n; ++i) {
+        y[i] += alpha * x[i];
     }
 }
 
-// q.shape   (seq, dKV, dQ, dHead)
-// k.shape   (seq, dKV, dHead)
-// v.shape   (seq, dKV, dHead)
-// out.shape (seq, dKV, dQ, dHead)
-Activation selfAttention(const Activation& q,
-                         const Activation& k,
-                         const Activation& v,
-                         unsigned dKV,
-                         unsigned dQ,
-                         unsigned dHead) {
-    Activation out(q.size);
-    auto dSeq = k.size / (dKV * dHead);
-    for (auto iKV = 0u; iKV < dKV; ++iKV) {
-        for (auto sQ = 0u; sQ < dSeq; ++sQ) {
-            for (auto iQ = 0u; iQ < dQ; ++iQ) {
-                Activation scores(sQ + 1);
-                for (auto sKV = 0u; sKV <= sQ; ++sKV) {
-                    float sum = 0;
-                    for (auto i = 0u; i < dHead; ++i) {
-                        sum += q.data[sQ * dKV * dQ * dHead + iKV * dQ * dHead + iQ * dHead + i] *
-                               k.data[sKV * dKV * dHead + iKV * dHead + i];
-                    }
-                    scores.data[sKV] = sum / std::sqrt(static_cast<float>(dHead));
-                }
-                softmaxInPlace(scores);
-                for (auto i = 0u; i < dHead; ++i) {
-                    float sum = 0;
-                    for (auto sKV = 0u; sKV <= sQ; ++sKV) {
-                        sum += scores.data[sKV] * v.data[sKV * dKV * dHead + iKV * dHead + i];
-                    }
-                    out.data[sQ * dKV * dQ * dHead + iKV * dQ * dHead + iQ * dHead + i] = sum;
+void dotRowsScalar(const float* x, const float* w, unsigned ldw, unsigned m, unsigned n, float* y) {
+    for (auto t = 0u; t < m; ++t) {
+        y[t] = dotScalar(x, w + t * ldw, n);
+    }
+}
+
+void axpyRowsScalar(const float* alpha,
+                    const float* w,
+                    unsigned ldw,
+                    unsigned m,
+                    unsigned n,
+                    float* y) {
+    for (auto t = 0u; t < m; ++t) {
+        axpyScalar(alpha[t], w + t * ldw, y, n);
+    }
+}
+
+void dotRowsI8Scalar(const float* x,
+                     const int8_t* w,
+                     unsigned ldw,
+                     unsigned m,
+                     unsigned n,
+                     float* y) {
+    for (auto t = 0u; t < m; ++t) {
+        y[t] = dotI8Scalar(x, w + t * ldw, n);
+    }
+}
+
+void axpyRowsI8Scalar(const float* alpha,
+                      const int8_t* w,
+                      unsigned ldw,
+                      unsigned m,
+                      unsigned n,
+                      float* y) {
+    for (auto t = 0u; t < m; ++t) {
+        for (auto i = 0u; i < n; ++i) {
+            y[i] += alpha[t] * w[t * ldw + i];
+        }
+    }
+}
+
+void rotateScalar(const float* x, const float* cos, const float* sin, unsigned n, float* y) {
+    for (auto i = 0u; i < n; ++i) {
+        auto re = x[i], im = x[i + n];
+        y[i] = cos[i] * re - sin[i] * im;
+        y[i + n] = cos[i] * im + sin[i] * re;
+    }
+}
+
+struct GemmScalar {
+    static constexpr unsigned MR = 4, NR = 8;
+
+    template <unsigned Rows>
+    static void tile(const float* panel, const float* x, unsigned ldx, unsigned kc, float* c) {
+        for (auto i = 0u; i < kc; ++i) {
+            for (auto r = 0u; r < Rows; ++r) {
+                for (auto j = 0u; j < NR; ++j) {
+                    c[r * NR + j] += x[r * ldx + i] * panel[i * NR + j];
                 }
             }
         }
     }
-    return out;
+};
+
+// AVX2
+
+// bf16 -> float is a zero-extend and shift into the top 16 bits
+LP_TARGET_AVX2 inline __m256 loadBf16Avx2(const bf16* w) {
+    auto wi = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(w)));
+    return _mm256_castsi256_ps(_mm256_slli_epi32(wi, 16));
 }
 
-void addInPlace(Activation& lhs, const Activation& rhs) {
-    for (auto i = 0u; i < lhs.size; ++i) {
-        lhs.data[i] += rhs.data[i];
+LP_TARGET_AVX2 inline float reduceAvx2(__m256 x) {
+    auto x4 = _mm_add_ps(_mm256_castps256_ps128(x), _mm256_extractf128_ps(x, 1));
+    x4 = _mm_hadd_ps(x4, x4);
+    return _mm_cvtss_f32(_mm_hadd_ps(x4, x4));
+}
+
+LP_TARGET_AVX2 float dotBf16Avx2(const float* x, const bf16* w, unsigned n) {
+    __m256 acc[4] = {_mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(),
+                     _mm256_setzero_ps()};
+    auto i = 0u;
+    for (; i + 32 <= n; i += 32) {
+        for (auto a = 0u; a < 4; ++a) {
+            acc[a] = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 8 * a), loadBf16Avx2(w + i + 8 * a),
+                                     acc[a]);
+        }
+    }
+    for (; i + 8 <= n; i += 8) {
+        acc[0] = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), loadBf16Avx2(w + i), acc[0]);
     }
+    auto sum = reduceAvx2(
+        _mm256_add_ps(_mm256_add_ps(acc[0], acc[1]), _mm256_add_ps(acc[2], acc[3])));
+    return sum + dotBf16Scalar(x + i, w + i, n - i);
 }
 
-void swiGluInPlace(Activation& x, const Activation& gate) {
-    for (auto i = 0u; i < x.size; ++i) {
-        x.data[i] *= gate.data[i] / (1 + std::exp(-gate.data[i]));
+LP_TARGET_AVX2 float dotI8Avx2(const float* x, const int8_t* w, unsigned n) {
+    __m256 acc[4] = {_mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(),
+                     _mm256_setzero_ps()};
+    auto i = 0u;
+    for (; i + 32 <= n; i += 32) {
+        for (auto a = 0u; a < 4; ++a) {
+            auto wa = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(w + i + 8 * a));
+            auto wf = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(wa));
+            acc[a] = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 8 * a), wf, acc[a]);
+        }
     }
+    auto sum = reduceAvx2(
+        _mm256_add_ps(_mm256_add_ps(acc[0], acc[1]), _mm256_add_ps(acc[2], acc[3])));
+    return sum + dotI8Scalar(x + i, w + i, n - i);
 }
 
-///////////////////////////////////////////////////////////////////////////////
-// Model ops
+LP_TARGET_AVX2 float dotQ4Avx2(const float* x,
+                               const uint8_t* q,
+                               const float* scale,
+                               const float* offset,
+                               unsigned groupSize,
+                               unsigned n) {
+    auto mask = _mm256_set1_epi32(0xF);
+    __m256 acc[2] = {_mm256_setzero_ps(), _mm256_setzero_ps()};
+    for (auto g = 0u; g < n / groupSize; ++g) {
+        auto s = _mm256_set1_ps(scale[g]);
+        auto o = _mm256_set1_ps(offset ? offset[g] : -8 * scale[g]);
+        for (auto b = g * groupSize; b < (g + 1) * groupSize; b += Q4Block) {
+            // Each half of the block's bytes holds values [8h, 8h + 8) & [16 + 8h, 24 + 8h)
+            for (auto h = 0u; h < 2; ++h) {
+                auto bytes = _mm256_cvtepu8_epi32(
+                    _mm_loadl_epi64(reinterpret_cast<const __m128i*>(q + b / 2 + 8 * h)));
+                auto lo = _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_and_si256(bytes, mask)), s, o);
+                auto hi = _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(bytes, 4)), s, o);
+                acc[0] = _mm256_fmadd_ps(_mm256_loadu_ps(x + b + 8 * h), lo, acc[0]);
+                acc[1] = _mm256_fmadd_ps(_mm256_loadu_ps(x + b + 16 + 8 * h), hi, acc[1]);
+            }
+        }
+    }
+    return reduceAvx2(_mm256_add_ps(acc[0], acc[1]));
+}
 
-Activation attention(const Model& model, const Layer& layer, const Activation& x) {
-    auto z = rmsNorm(x, layer.attnNorm.get_bf16(), model.dModel, model.normEps);
-    auto q = project(z, layer.attnQ.get_bf16(), model.dModel,
-                     model.dAttnKV * model.dAttnQ * model.dAttnHead);
-    auto k = project(z, layer.attnK.get_bf16(), model.dModel, model.dAttnKV * model.dAttnHead);
-    auto v = project(z, layer.attnV.get_bf16(), model.dModel, model.dAttnKV * model.dAttnHead);
-    q = rotate(q, model.ropeFreq, model.dAttnKV * model.dAttnQ);
-    k = rotate(k, model.ropeFreq, model.dAttnKV);
-    auto mix = selfAttention(q, k, v, model.dAttnKV, model.dAttnQ, model.dAttnHead);
-    return project(mix, layer.attnO.get_bf16(), model.dAttnKV * model.dAttnQ * model.dAttnHead,
-                   model.dModel);
+LP_TARGET_AVX2 float dotAvx2(const float* a, const float* b, unsigned n) {
+    auto acc = _mm256_setzero_ps();
+    auto i = 0u;
+    for (; i + 8 <= n; i += 8) {
+        acc = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc);
+    }
+    return reduceAvx2(acc) + dotScalar(a + i, b + i, n - i);
 }
 
-Activation mlp(const Model& model, const Layer& layer, const Activation& x) {
-    auto z = rmsNorm(x, layer.mlpNorm.get_bf16(), model.dModel, model.normEps);
-    auto up = project(z, layer.mlpUp.get_bf16(), model.dModel, model.dFFN);
-    auto gate = project(z, layer.mlpGate.get_bf16(), model.dModel, model.dFFN);
-    swiGluInPlace(up, gate);
-    return project(up, layer.mlpDown.get_bf16(), model.dFFN, model.dModel);
+LP_TARGET_AVX2 void dotRowsAvx2(const float* x,
+                                const float* w,
+                                unsigned ldw,
+                                unsigned m,
+                                unsigned n,
+                                float* y) {
+    for (auto t = 0u; t < m; ++t) {
+        y[t] = dotAvx2(x, w + t * ldw, n);
+    }
 }
 
-void predict(const Model& model, const std::vector<unsigned>& tokens) {
-    auto timer = Stopwatch();
-    auto hidden = embeddingLookup(tokens, model.embedTokens.get_bf16(), model.dModel);
-    for (auto& layer : model.layers) {
-        addInPlace(hidden, attention(model, layer, hidden));
-        addInPlace(hidden, mlp(model, layer, hidden));
+// Accumulates each 32-wide chunk of y in registers across all rows of w
+LP_TARGET_AVX2 void axpyRowsAvx2(const float* alpha,
+                                 const float* w,
+                                 unsigned ldw,
+                                 unsigned m,
+                                 unsigned n,
+                                 float* y) {
+    auto i = 0u;
+    for (; i + 32 <= n; i += 32) {
+        __m256 acc[4];
+        for (auto c = 0u; c < 4; ++c) acc[c] = _mm256_loadu_ps(y + i + 8 * c);
+        for (auto t = 0u; t < m; ++t) {
+            auto a = _mm256_set1_ps(alpha[t]);
+            for (auto c = 0u; c < 4; ++c) {
+                acc[c] = _mm256_fmadd_ps(a, _mm256_loadu_ps(w + t * ldw + i + 8 * c), acc[c]);
+            }
+        }
+        for (auto c = 0u; c < 4; ++c) _mm256_storeu_ps(y + i + 8 * c, acc[c]);
     }
-    hidden = rmsNorm(hidden, model.finalNorm.get_bf16(), model.dModel, model.normEps);
-    auto logits = project(hidden, model.embedTokens.get_bf16(), model.dModel, model.dVocab);
-    auto begin = logits.data.get() + logits.size - model.dVocab;
-    auto nextToken = std::max_element(begin, logits.data.get() + logits.size) - begin;
-    std::cout << nextToken << " in " << timer.elapsed() << " s" << std::endl;
+    if (i < n) axpyRowsScalar(alpha, w + i, ldw, m, n - i, y + i);
 }
 
-}  // namespace lp
+LP_TARGET_AVX2 void dotRowsI8Avx2(const float* x,
+                                  const int8_t* w,
+                                  unsigned ldw,
+                                  unsigned m,
+                                  unsigned n,
+                                  float* y) {
+    for (auto t = 0u; t < m; ++t) {
+        y[t] = dotI8Avx2(x, w + t * ldw, n);
+    }
+}
 
-///////////////////////////////////////////////////////////////////////////////
-// Driver program
+LP_TARGET_AVX2 void axpyRowsI8Avx2(const float* alpha,
+                                   const int8_t* w,
+                                   unsigned ldw,
+                                   unsigned m,
+                                   unsigned n,
+                                   float* y) {
+    auto i = 0u;
+    for (; i + 32 <= n; i += 32) {
+        __m256 acc[4];
+        for (auto c = 0u; c < 4; ++c) acc[c] = _mm256_loadu_ps(y + i + 8 * c);
+        for (auto t = 0u; t < m; ++t) {
+            auto a = _mm256_set1_ps(alpha[t]);
+            for (auto c = 0u; c < 4; ++c) {
+                auto wc = _mm_loadl_epi64(
+                    reinterpret_cast<const __m128i*>(w + t * ldw + i + 8 * c));
+                auto wf = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(wc));
+                acc[c] = _mm256_fmadd_ps(a, wf, acc[c]);
+            }
+        }
+        for (auto c = 0u; c < 4; ++c) _mm256_storeu_ps(y + i + 8 * c, acc[c]);
+    }
+    if (i < n) axpyRowsI8Scalar(alpha, w + i, ldw, m, n - i, y + i);
+}
 
-int main(int argc, char** argv) {
-    if (argc < 3) {
-        throw std::runtime_error(
-            "Not enough arguments."
-            " Usage: ./model path/to/config.json path/to/model.safetensors");
+LP_TARGET_AVX2 void rotateAvx2(const float* x,
+                               const float* cos,
+                               const float* sin,
+                               unsigned n,
+                               float* y) {
+    auto i = 0u;
+    for (; i + 8 <= n; i += 8) {
+        auto re = _mm256_loadu_ps(x + i), im = _mm256_loadu_ps(x + i + n);
+        auto c = _mm256_loadu_ps(cos + i), s = _mm256_loadu_ps(sin + i);
+        _mm256_storeu_ps(y + i, _mm256_fmsub_ps(c, re, _mm256_mul_ps(s, im)));
+        _mm256_storeu_ps(y + i + n, _mm256_fmadd_ps(c, im, _mm256_mul_ps(s, re)));
+    }
+    for (; i < n; ++i) {
+        auto re = x[i], im = x[i + n];
+        y[i] = cos[i] * re - sin[i] * im;
+        y[i + n] = cos[i] * im + sin[i] * re;
     }
+}
 
-    std::ifstream configFile(argv[1]);
-    auto model = lp::loadConfig(configFile);
-    std::ifstream dataFile(argv[2]);
-    lp::loadParameters(model, dataFile);
+struct GemmAvx2 {
+    static constexpr unsigned MR = 6, NR = 16;
 
-    std::string line;
-    while (std::getline(std::cin, line)) {
-        std::istringstream lineS(line);
-        std::vector<unsigned> tokens;
-        while (lineS.good()) {
-            unsigned token;
-            if (lineS >> token) {
-                tokens.push_back(token);
+    template <unsigned Rows>
+    LP_TARGET_AVX2 static void tile(const float* panel,
+                                    const float* x,
+                                    unsigned ldx,
+                                    unsigned kc,
+                                    float* c) {
+        __m256 acc[Rows][2];
+        for (auto r = 0u; r < Rows; ++r) {
+            acc[r][0] = _mm256_loadu_ps(c + r * NR);
+            acc[r][1] = _mm256_loadu_ps(c + r * NR + 8);
+        }
+        for (auto i = 0u; i < kc; ++i) {
+            auto w0 = _mm256_loadu_ps(panel + i * NR);
+            auto w1 = _mm256_loadu_ps(panel + i * NR + 8);
+            for (auto r = 0u; r < Rows; ++r) {
+                auto xr = _mm256_broadcast_ss(x + r * ldx + i);
+                acc[r][0] = _mm256_fmadd_ps(xr, w0, acc[r][0]);
+                acc[r][1] = _mm256_fmadd_ps(xr, w1, acc[r][1]);
             }
         }
-        lp::predict(model, tokens);
-        lp::predict(model, tokens);
+        for (auto r = 0u; r < Rows; ++r) {
+            _mm256_storeu_ps(c + r * NR, acc[r][0]);
+            _mm256_storeu_ps(c + r * NR + 8, acc[r][1]);
+        }
+    }
+};
+
+// AVX-512F
+
+LP_TARGET_AVX512F inline __m512 loadBf16Avx512(const bf16* w) {
+    auto wi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(w));
+    return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(wi), 16));
+}
+
+LP_TARGET_AVX512F float dotBf16Avx512(const float* x, const bf16* w, unsigned n) {
+    __m512 acc[4] = {_mm512_setzero_ps(), _mm512_setzero_ps(), _mm512_setzero_ps(),
+                     _mm512_setzero_ps()};
+    auto i = 0u;
+    for (; i + 64 <= n; i += 64) {
+        for (auto a = 0u; a < 4; ++a) {
+            acc[a] = _mm512_fmadd_ps(_mm512_loadu_ps(x + i + 16 * a),
+                                     loadBf16Avx512(w + i + 16 * a), acc[a]);
+        }
+    }
+    for (; i + 16 <= n; i += 16) {
+        acc[0] = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), loadBf16Avx512(w + i), acc[0]);
+    }
+    auto sum = _mm512_reduce_add_ps(
+        _mm512_add_ps(_mm512_add_ps(acc[0], acc[1]), _mm512_add_ps(acc[2], acc[3])));
+    return sum + dotBf16Scalar(x + i, w + i, n - i);
+}
+
+LP_TARGET_AVX512F float dotI8Avx512(const float* x, const int8_t* w, unsigned n) {
+    __m512 acc[4] = {_mm512_setzero_ps(), _mm512_setzero_ps(), _mm512_setzero_ps(),
+                     _mm512_setzero_ps()};
+    auto i = 0u;
+    for (; i + 64 <= n; i += 64) {
+        for (auto a = 0u; a < 4; ++a) {
+            auto wa = _mm_loadu_si128(reinterpret_cast<const __m128i*>(w + i + 16 * a));
+            auto wf = _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(wa));
+            acc[a] = _mm512_fmadd_ps(_mm512_loadu_ps(x + i + 16 * a), wf, acc[a]);
+        }
+    }
+    auto sum = _mm512_reduce_add_ps(
+        _mm512_add_ps(_mm512_add_ps(acc[0], acc[1]), _mm512_add_ps(acc[2], acc[3])));
+    return sum + dotI8Scalar(x + i, w + i, n - i);
+}
+
+LP_TARGET_AVX512F float dotQ4Avx512(const float* x,
+                                    const uint8_t* q,
+                                    const float* scale,
+                                    const float* offset,
+                                    unsigned groupSize,
+                                    unsigned n) {
+    auto mask = _mm512_set1_epi32(0xF);
+    __m512 acc[2] = {_mm512_setzero_ps(), _mm512_setzero_ps()};
+    for (auto g = 0u; g < n / groupSize; ++g) {
+        auto s = _mm512_set1_ps(scale[g]);
+        auto o = _mm512_set1_ps(offset ? offset[g] : -8 * scale[g]);
+        for (auto b = g * groupSize; b < (g + 1) * groupSize; b += Q4Block) {
+            auto bytes = _mm512_cvtepu8_epi32(
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(q + b / 2)));
+            auto lo = _mm512_fmadd_ps(_mm512_cvtepi32_ps(_mm512_and_si512(bytes, mask)), s, o);
+            auto hi = _mm512_fmadd_ps(_mm512_cvtepi32_ps(_mm512_srli_epi32(bytes, 4)), s, o);
+            acc[0] = _mm512_fmadd_ps(_mm512_loadu_ps(x + b), lo, acc[0]);
+            acc[1] = _mm512_fmadd_ps(_mm512_loadu_ps(x + b + 16), hi, acc[1]);
+        }
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(acc[0], acc[1]));
+}
+
+LP_TARGET_AVX512F float dotAvx512(const float* a, const float* b, unsigned n) {
+    auto acc = _mm512_setzero_ps();
+    auto i = 0u;
+    for (; i + 16 <= n; i += 16) {
+        acc = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc);
+    }
+    return _mm512_reduce_add_ps(acc) + dotScalar(a + i, b + i, n - i);
+}
+
+LP_TARGET_AVX512F void dotRowsAvx512(const float* x,
+                                     const float* w,
+                                     unsigned ldw,
+                                     unsigned m,
+                                     unsigned n,
+                                     float* y) {
+    for (auto t = 0u; t < m; ++t) {
+        y[t] = dotAvx512(x, w + t * ldw, n);
+    }
+}
+
+// Accumulates each 64-wide chunk of y in registers across all rows of w
+LP_TARGET_AVX512F void axpyRowsAvx512(const float* alpha,
+                                      const float* w,
+                                      unsigned ldw,
+                                      unsigned m,
+                                      unsigned n,
+                                      float* y) {
+    auto i = 0u;
+    for (; i + 64 <= n; i += 64) {
+        __m512 acc[4];
+        for (auto c = 0u; c < 4; ++c) acc[c] = _mm512_loadu_ps(y + i + 16 * c);
+        for (auto t = 0u; t < m; ++t) {
+            auto a = _mm512_set1_ps(alpha[t]);
+            for (auto c = 0u; c < 4; ++c) {
+                acc[c] = _mm512_fmadd_ps(a, _mm512_loadu_ps(w + t * ldw + i + 16 * c), acc[c]);
+            }
+        }
+        for (auto c = 0u; c < 4; ++c) _mm512_storeu_ps(y + i + 16 * c, acc[c]);
+    }
+    if (i < n) axpyRowsScalar(alpha, w + i, ldw, m, n - i, y + i);
+}
+
+LP_TARGET_AVX512F void dotRowsI8Avx512(const float* x,
+                                       const int8_t* w,
+                                       unsigned ldw,
+                                       unsigned m,
+                                       unsigned n,
+                                       float* y) {
+    for (auto t = 0u; t < m; ++t) {
+        y[t] = dotI8Avx512(x, w + t * ldw, n);
+    }
+}
+
+LP_TARGET_AVX512F void axpyRowsI8Avx512(const float* alpha,
+                                        const int8_t* w,
+                                        unsigned ldw,
+                                        unsigned m,
+                                        unsigned n,
+                                        float* y) {
+    auto i = 0u;
+    for (; i + 64 <= n; i += 64) {
+        __m512 acc[4];
+        for (auto c = 0u; c < 4; ++c) acc[c] = _mm512_loadu_ps(y + i + 16 * c);
+        for (auto t = 0u; t < m; ++t) {
+            auto a = _mm512_set1_ps(alpha[t]);
+            for (auto c = 0u; c < 4; ++c) {
+                auto wc = _mm_loadu_si128(
+                    reinterpret_cast<const __m128i*>(w + t * ldw + i + 16 * c));
+                auto wf = _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(wc));
+                acc[c] = _mm512_fmadd_ps(a, wf, acc[c]);
+            }
+        }
+        for (auto c = 0u; c < 4; ++c) _mm512_storeu_ps(y + i + 16 * c, acc[c]);
+    }
+    if (i < n) axpyRowsI8Scalar(alpha, w + i, ldw, m, n - i, y + i);
+}
+
+LP_TARGET_AVX512F void rotateAvx512(const float* x,
+                                    const float* cos,
+                                    const float* sin,
+                                    unsigned n,
+                                    float* y) {
+    for (auto i = 0u; i < n; i += 16) {
+        auto mask = static_cast<__mmask16>(n - i >= 16 ? 0xffff : (1u << (n - i)) - 1);
+        auto re = _mm512_maskz_loadu_ps(mask, x + i), im = _mm512_maskz_loadu_ps(mask, x + i + n);
+        auto c = _mm512_maskz_loadu_ps(mask, cos + i), s = _mm512_maskz_loadu_ps(mask, sin + i);
+        _mm512_mask_storeu_ps(y + i, mask, _mm512_fmsub_ps(c, re, _mm512_mul_ps(s, im)));
+        _mm512_mask_storeu_ps(y + i + n, mask, _mm512_fmadd_ps(c, im, _mm512_mul_ps(s, re)));
+    }
+}
+
+struct GemmAvx512 {
+    static constexpr unsigned MR = 8, NR = 32;
+
+    template <unsigned Rows>
+    LP_TARGET_AVX512F static void tile(const float* panel,
+                                       const float* x,
+                                       unsigned ldx,
+                                       unsigned kc,
+                                       float* c) {
+        __m512 acc[Rows][2];
+        for (auto r = 0u; r < Rows; ++r) {
+            acc[r][0] = _mm512_loadu_ps(c + r * NR);
+            acc[r][1] = _mm512_loadu_ps(c + r * NR + 16);
+        }
+        for (auto i = 0u; i < kc; ++i) {
+            auto w0 = _mm512_loadu_ps(panel + i * NR);
+            auto w1 = _mm512_loadu_ps(panel + i * NR + 16);
+            for (auto r = 0u; r < Rows; ++r) {
+                auto xr = _mm512_set1_ps(x[r * ldx + i]);
+                acc[r][0] = _mm512_fmadd_ps(xr, w0, acc[r][0]);
+                acc[r][1] = _mm512_fmadd_ps(xr, w1, acc[r][1]);
+            }
+        }
+        for (auto r = 0u; r < Rows; ++r) {
+            _mm512_storeu_ps(c + r * NR, acc[r][0]);
+            _mm512_storeu_ps(c + r * NR + 16, acc[r][1]);
+        }
+    }
+};
+
+// AVX512-BF16: activations are rounded to bf16 once per op, then VDPBF16PS multiplies pairs of
+// bf16 values, accumulating in fp32
+
+LP_TARGET_AVX512BF16 void toBf16Avx512Bf16(const float* x, unsigned n, bf16* y) {
+    auto i = 0u;
+    for (; i + 32 <= n; i += 32) {
+        auto pair = _mm512_cvtne2ps_pbh(_mm512_loadu_ps(x + i + 16), _mm512_loadu_ps(x + i));
+        _mm512_storeu_si512(y + i, reinterpret_cast<__m512i>(pair));
+    }
+    for (; i < n; ++i) {
+        y[i] = float_to_bf16(x[i]);
+    }
+}
+
+LP_TARGET_AVX512BF16 float dotBf16Avx512Bf16(const bf16* x, const bf16* w, unsigned n) {
+    __m512 acc[2] = {_mm512_setzero_ps(), _mm512_setzero_ps()};
+    auto i = 0u;
+    for (; i + 64 <= n; i += 64) {
+        for (auto a = 0u; a < 2; ++a) {
+            auto xa = reinterpret_cast<__m512bh>(_mm512_loadu_si512(x + i + 32 * a));
+            auto wa = reinterpret_cast<__m512bh>(_mm512_loadu_si512(w + i + 32 * a));
+            acc[a] = _mm512_dpbf16_ps(acc[a], xa, wa);
+        }
+    }
+    for (; i + 32 <= n; i += 32) {
+        auto xa = reinterpret_cast<__m512bh>(_mm512_loadu_si512(x + i));
+        auto wa = reinterpret_cast<__m512bh>(_mm512_loadu_si512(w + i));
+        acc[0] = _mm512_dpbf16_ps(acc[0], xa, wa);
+    }
+    auto sum = _mm512_reduce_add_ps(_mm512_add_ps(acc[0], acc[1]));
+    for (; i < n; ++i) {
+        sum += bf16_to_float(x[i]) * bf16_to_float(w[i]);
+    }
+    return sum;
+}
+
+void gemvBf16Avx512Bf16(const bf16* x,
+                        const Parameter& w,
+                        unsigned dIn,
+                        unsigned j0,
+                        unsigned j1,
+                        float* y) {
+    for (auto j = j0; j < j1; ++j) {
+        y[j - j0] = dotBf16Avx512Bf16(x, w.get_bf16() + j * dIn, dIn);
+    }
+}
+
+// As GemmAvx512, broadcasting a pair of bf16 inputs of each row against the panel's pairs
+struct GemmAvx512Bf16 {
+    static constexpr unsigned MR = 8, NR = 32;
+
+    template <unsigned Rows>
+    LP_TARGET_AVX512BF16 static void tile(const bf16* panel,
+                                          const bf16* x,
+                                          unsigned ldx,
+                                          unsigned kc,
+                                          float* c) {
+        __m512 acc[Rows][2];
+        for (auto r = 0u; r < Rows; ++r) {
+            acc[r][0] = _mm512_loadu_ps(c + r * NR);
+            acc[r][1] = _mm512_loadu_ps(c + r * NR + 16);
+        }
+        for (auto i = 0u; i < kc; i += 2) {
+            auto w0 = reinterpret_cast<__m512bh>(_mm512_loadu_si512(panel + i * NR));
+            auto w1 = reinterpret_cast<__m512bh>(_mm512_loadu_si512(panel + i * NR + 32));
+            for (auto r = 0u; r < Rows; ++r) {
+                int32_t pair;
+                std::memcpy(&pair, x + r * ldx + i, sizeof(pair));
+                auto xr = reinterpret_cast<__m512bh>(_mm512_set1_epi32(pair));
+                acc[r][0] = _mm512_dpbf16_ps(acc[r][0], xr, w0);
+                acc[r][1] = _mm512_dpbf16_ps(acc[r][1], xr, w1);
+            }
+        }
+        for (auto r = 0u; r < Rows; ++r) {
+            _mm512_storeu_ps(c + r * NR, acc[r][0]);
+            _mm512_storeu_ps(c + r * NR + 16, acc[r][1]);
+        }
+    }
+};
+
+// Dispatch
+
+// All kernel families supported by this CPU, best first
+// avx512bf16 rounds activations to bf16, which changes results, so must be selected by name
+std::vector<Kernels> availableKernels() {
+    std::vector<Kernels> kernels;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        kernels.push_back({"avx512f", gemvRows<dotBf16Avx512, dotI8Avx512, dotQ4Avx512>,
+                           gemmBlocked<GemmAvx512>, dotRowsAvx512, axpyRowsAvx512,
+                           dotRowsI8Avx512, axpyRowsI8Avx512, rotateAvx512, nullptr, nullptr,
+                           nullptr});
+    }
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bf16")) {
+        kernels.push_back({"avx512bf16", gemvRows<dotBf16Avx512, dotI8Avx512, dotQ4Avx512>,
+                           gemmBlocked<GemmAvx512>, dotRowsAvx512, axpyRowsAvx512,
+                           dotRowsI8Avx512, axpyRowsI8Avx512, rotateAvx512, toBf16Avx512Bf16,
+                           gemvBf16Avx512Bf16, gemmBlocked<GemmAvx512Bf16>});
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        kernels.push_back({"avx2", gemvRows<dotBf16Avx2, dotI8Avx2, dotQ4Avx2>,
+                           gemmBlocked<GemmAvx2>, dotRowsAvx2, axpyRowsAvx2, dotRowsI8Avx2,
+                           axpyRowsI8Avx2, rotateAvx2, nullptr, nullptr, nullptr});
+    }
+    kernels.push_back({"scalar", gemvRows<dotBf16Scalar, dotI8Scalar, dotQ4Scalar>,
+                       gemmBlocked<GemmScalar>, dotRowsScalar, axpyRowsScalar, dotRowsI8Scalar,
+                       axpyRowsI8Scalar, rotateScalar, nullptr, nullptr, nullptr});
+    return kernels;
+}
+
+// Select kernels by name, or the best available if `name` is empty
+Kernels selectKernels(const std::string& name) {
+    auto kernels = availableKernels();
+    if (name.empty()) return kernels.front();
+    for (auto& k : kernels) {
+        if (k.name == name) return k;
+    }
+    throw std::invalid_argument(std::format("Kernels \"{}\" not supported on this CPU", name));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Model
+
+struct Layer {
+    Parameter attnNorm;
+    Parameter attnQKV;  // rows of q_proj, then k_proj, then v_proj
+    Parameter attnO;
+
+    Parameter mlpNorm;
+    Parameter mlpGate;
+    Parameter mlpUp;
+    Parameter mlpDown;
+};
+
+// cos & sin of ropeFreq[i] * position, shape (length, len(ropeFreq)), grown on demand
+struct RopeTable {
+    unsigned length = 0;
+    std::vector<float> cos;
+    std::vector<float> sin;
+};
+
+struct Model {
+    unsigned nLayers;
+    unsigned dVocab;
+    unsigned dModel;
+    unsigned dFFN;
+    unsigned dAttnHead;
+    unsigned dAttnKV;
+    unsigned dAttnQ;
+    std::vector<float> ropeFreq;
+    float normEps;
+    std::set<unsigned> eosTokens;
+    Kernels kernels;
+    KVDType kvDType = KVDType::F32;
+    mutable RopeTable rope;
+
+    Parameter embedTokens;
+    std::vector<Layer> layers;
+    Parameter finalNorm;
+
+    // Backing storage for parameters, either copied (_parameterData) or mapped (_parameterMap)
+    Buffer<char> _parameterData;
+    std::unique_ptr<MappedFile> _parameterMap;
+    std::vector<Buffer<char>> _derivedData;  // parameters built at load (fused, quantized)
+
+    Model() = default;
+    Model(const Model&) = delete;
+    Model(Model&&) = default;
+    Model& operator=(const Model&) = delete;
+    Model& operator=(Model&&) = default;
+};
+
+Model loadConfig(std::istream& file) {
+    auto config = json::parse(file);
+
+    Model m;
+    m.kernels = selectKernels("");
+    m.nLayers = config["num_hidden_layers"].template get<unsigned>();
+    m.dVocab = config["vocab_size"].template get<unsigned>();
+    m.dModel = config["hidden_size"].template get<unsigned>();
+    m.dFFN = config["intermediate_size"].template get<unsigned>();
+    m.dAttnHead = config["head_dim"].template get<unsigned>();
+    m.dAttnKV = config["num_key_value_heads"].template get<unsigned>();
+    m.dAttnQ = config["num_attention_heads"].template get<unsigned>() / m.dAttnKV;
+    m.normEps = config["rms_norm_eps"].template get<float>();
+    if (config.contains("eos_token_id")) {
+        auto eos = config["eos_token_id"];
+        if (eos.is_array()) {
+            for (auto& e : eos) m.eosTokens.insert(e.template get<unsigned>());
+        } else if (!eos.is_null()) {
+            m.eosTokens.insert(eos.template get<unsigned>());
+        }
+    }
+
+    auto theta = config["rope_theta"].template get<float>();
+    auto scaling = config["rope_scaling"];
+    auto factor = scaling["factor"].template get<float>();
+    auto lowFreqFactor = scaling["low_freq_factor"].template get<float>();
+    auto highFreqFactor = scaling["high_freq_factor"].template get<float>();
+    auto originalLength = scaling["original_max_position_embeddings"].template get<unsigned>();
+
+    for (auto i = 0u; i < m.dAttnHead; i += 2) {
+        auto freq = std::pow(theta, -static_cast<float>(i) / m.dAttnHead);
+        auto z = (originalLength * freq / (2 * static_cast<float>(M_PI)) - lowFreqFactor) /
+                 (highFreqFactor - lowFreqFactor);
+        z = std::clamp(z, 0.f, 1.f);
+        m.ropeFreq.push_back(freq * ((1 - z) / factor + z));
+    }
+    return m;
+}
+
+json parseParameterHeader(const std::string& headerData) {
+    auto header = json::parse(headerData);
+    header.erase("__metadata__");
+    return header;
+}
+
+uint64_t parameterDataSize(const json& header) {
+    uint64_t maxOffset(0);
+    for (auto e : header.items()) {
+        maxOffset = std::max(maxOffset, e.value()["data_offsets"][1].template get<uint64_t>());
+    }
+    return maxOffset;
+}
+
+// Output channels of the gate & up projections computed together, so that each block can apply
+// up * silu(gate) as soon as it is computed
+constexpr unsigned GluBlock = 32;
+
+// Alignment of each thread's range of output channels, a multiple of every GEMM panel width
+constexpr unsigned ProjectAlign = 32;
+
+// Concatenate BF16 parameters along the output (row) dimension
+// Each part is (parameter, rows), with `dIn` columns
+Parameter concatenateRows(Model& model,
+                          const std::vector<std::pair<Parameter, unsigned>>& parts,
+                          unsigned dIn) {
+    size_t size = 0;
+    for (auto& [p, rows] : parts) size += size_t(rows) * dIn * sizeof(bf16);
+    auto& storage = model._derivedData.emplace_back(allocate<char>(size));
+    auto out = storage.get();
+    for (auto& [p, rows] : parts) {
+        auto bytes = size_t(rows) * dIn * sizeof(bf16);
+        std::memcpy(out, p.data, bytes);
+        out += bytes;
+    }
+    return {storage.get()};
+}
+
+// Point each Parameter at its tensor within `data` (the safetensors buffer, after the header)
+void setParameters(Model& model, const json& header, const char* data) {
+    auto load = [data, &header](const std::string& name) -> Parameter {
+        auto j = header["model." + name + ".weight"];
+        if (j["dtype"].template get<std::string>() != "BF16") {
+            throw std::invalid_argument("Non-BF16 data");
+        }
+        auto start = j["data_offsets"][0].template get<uint64_t>();
+        return {data + start};
+    };
+    auto dQ = model.dAttnKV * model.dAttnQ * model.dAttnHead;
+    auto dKV = model.dAttnKV * model.dAttnHead;
+    model.embedTokens = load("embed_tokens");
+    model.layers.clear();
+    model._derivedData.clear();
+    for (auto idx = 0u; idx < model.nLayers; ++idx) {
+        auto pre = std::format("layers.{}.", idx);
+        Layer layer;
+        layer.attnNorm = load(pre + "input_layernorm");
+        layer.attnQKV = concatenateRows(model,
+                                        {{load(pre + "self_attn.q_proj"), dQ},
+                                         {load(pre + "self_attn.k_proj"), dKV},
+                                         {load(pre + "self_attn.v_proj"), dKV}},
+                                        model.dModel);
+        layer.attnO = load(pre + "self_attn.o_proj");
+        layer.mlpNorm = load(pre + "post_attention_layernorm");
+        layer.mlpGate = load(pre + "mlp.gate_proj");
+        layer.mlpUp = load(pre + "mlp.up_proj");
+        layer.mlpDown = load(pre + "mlp.down_proj");
+        model.layers.push_back(layer);
+    }
+    model.finalNorm = load("norm");
+}
+
+// Copy all parameters into memory owned by the model
+void loadParameters(Model& model, std::istream& file) {
+    uint64_t nHeader(0);
+    file.read(reinterpret_cast<char*>(&nHeader), sizeof(nHeader));
+
+    // Read the JSON header
+    std::string headerData(nHeader, '\0');
+    file.read(headerData.data(), headerData.size());
+    auto header = parseParameterHeader(headerData);
+    auto maxOffset = parameterDataSize(header);
+
+    // Read the data buffer, in chunks
+    model._parameterData = allocate<char>(maxOffset);
+    constexpr uint64_t chunkSize(1 << 16);
+    for (auto i = uint64_t(0); i < maxOffset; i += chunkSize) {
+        file.read(model._parameterData.get() + i, std::min(chunkSize, maxOffset - i));
+    }
+    if (!file) {
+        throw std::runtime_error("Truncated safetensors file");
+    }
+    setParameters(model, header, model._parameterData.get());
+}
+
+// Map the file read-only, so that parameters are paged in on demand & shared between processes
+void mapParameters(Model& model, const std::string& path) {
+    auto file = std::make_unique<MappedFile>(path);
+    uint64_t nHeader(0);
+    if (file->size < sizeof(nHeader)) {
+        throw std::runtime_error("Truncated safetensors file");
+    }
+    std::memcpy(&nHeader, file->data, sizeof(nHeader));
+    if (file->size < sizeof(nHeader) + nHeader) {
+        throw std::runtime_error("Truncated safetensors file");
+    }
+    auto header = parseParameterHeader(std::string(file->data + sizeof(nHeader), nHeader));
+    auto data = file->data + sizeof(nHeader) + nHeader;
+    if (file->size < sizeof(nHeader) + nHeader + parameterDataSize(header)) {
+        throw std::runtime_error("Truncated safetensors file");
+    }
+    setParameters(model, header, data);
+    model._parameterData.reset();
+    model._parameterMap = std::move(file);
+}
+
+// Call fn(parameter, dIn, dOut) for each projection in the layer
+template <class Fn>
+void forEachProjection(const Model& model, Layer& layer, Fn fn) {
+    auto dQ = model.dAttnKV * model.dAttnQ * model.dAttnHead;
+    auto dKV = model.dAttnKV * model.dAttnHead;
+    fn(layer.attnQKV, model.dModel, dQ + 2 * dKV);
+    fn(layer.attnO, dQ, model.dModel);
+    fn(layer.mlpGate, model.dModel, model.dFFN);
+    fn(layer.mlpUp, model.dModel, model.dFFN);
+    fn(layer.mlpDown, model.dFFN, model.dModel);
+}
+
+// Symmetric per-output-channel int8, w[j, i] ~= scale[j] * q[j, i]
+// Storage layout: scale (dOut floats), then q (dOut * dIn int8)
+Parameter quantizeI8(const Parameter& w, unsigned dIn, unsigned dOut, Buffer<char>& storage) {
+    storage = allocate<char>(dOut * sizeof(float) + size_t(dOut) * dIn);
+    auto scale = reinterpret_cast<float*>(storage.get());
+    auto q = reinterpret_cast<int8_t*>(storage.get() + dOut * sizeof(float));
+    auto src = w.get_bf16();
+    parallelFor(dOut, [&](size_t j) {
+        float absMax = 0;
+        for (auto i = 0u; i < dIn; ++i) {
+            absMax = std::max(absMax, std::abs(bf16_to_float(src[j * dIn + i])));
+        }
+        scale[j] = absMax ? absMax / 127 : 1;
+        for (auto i = 0u; i < dIn; ++i) {
+            auto value = std::lround(bf16_to_float(src[j * dIn + i]) / scale[j]);
+            q[j * dIn + i] = static_cast<int8_t>(value);
+        }
+    });
+    return {q, DType::I8, scale};
+}
+
+// 4-bit, with a scale per group of `groupSize` values along each row, and either a per-group
+// offset (w ~= scale * q + offset, q in [0, 16)) or symmetric (w ~= scale * (q - 8))
+// Storage layout: scale (dOut * dIn / groupSize floats), offset (same, if used), then q (packed
+// in blocks of Q4Block, dOut * dIn / 2 bytes)
+Parameter quantizeQ4(const Parameter& w,
+                     unsigned dIn,
+                     unsigned dOut,
+                     unsigned groupSize,
+                     bool useOffset,
+                     Buffer<char>& storage) {
+    if (groupSize % Q4Block != 0 || dIn % groupSize != 0) {
+        throw std::invalid_argument(
+            std::format("Q4 group size {} must be a multiple of {} dividing {}", groupSize,
+                        Q4Block, dIn));
+    }
+    auto nGroups = size_t(dOut) * dIn / groupSize;
+    auto groupBytes = (useOffset ? 2 : 1) * nGroups * sizeof(float);
+    storage = allocate<char>(groupBytes + size_t(dOut) * dIn / 2);
+    auto scale = reinterpret_cast<float*>(storage.get());
+    auto offset = useOffset ? scale + nGroups : nullptr;
+    auto q = reinterpret_cast<uint8_t*>(scale + (useOffset ? 2 : 1) * nGroups);
+    auto src = w.get_bf16();
+    parallelFor(nGroups, [&](size_t g) {
+        auto group = src + g * groupSize;
+        float min = bf16_to_float(group[0]), max = min;
+        for (auto i = 0u; i < groupSize; ++i) {
+            min = std::min(min, bf16_to_float(group[i]));
+            max = std::max(max, bf16_to_float(group[i]));
+        }
+        float off;
+        if (useOffset) {
+            scale[g] = max > min ? (max - min) / 15 : 1;
+            off = offset[g] = min;
+        } else {
+            auto absMax = std::max(-min, max);
+            scale[g] = absMax ? absMax / 7 : 1;
+            off = -8 * scale[g];
+        }
+        auto packed = q + g * groupSize / 2;
+        for (auto b = 0u; b < groupSize; b += Q4Block) {
+            for (auto i = 0u; i < Q4Block / 2; ++i) {
+                auto quantize = [&](unsigned idx) {
+                    auto value = std::lround((bf16_to_float(group[idx]) - off) / scale[g]);
+                    return static_cast<uint8_t>(std::clamp<long>(value, 0, 15));
+                };
+                packed[b / 2 + i] = quantize(b + i) | (quantize(b + i + Q4Block / 2) << 4);
+            }
+        }
+    });
+    return {q, DType::Q4, scale, offset, groupSize};
+}
+
+// ||w - reference|| / ||reference||
+double relativeError(const Parameter& reference, const Parameter& w, unsigned dIn, unsigned dOut) {
+    std::vector<float> rowRef(dIn), row(dIn);
+    double sumSqErr = 0, sumSqRef = 0;
+    for (auto j = 0u; j < dOut; ++j) {
+        unpackRow(reference, dIn, j, 0, dIn, rowRef.data());
+        unpackRow(w, dIn, j, 0, dIn, row.data());
+        for (auto i = 0u; i < dIn; ++i) {
+            sumSqErr += (row[i] - rowRef[i]) * (row[i] - rowRef[i]);
+            sumSqRef += rowRef[i] * rowRef[i];
+        }
+    }
+    return std::sqrt(sumSqErr / sumSqRef);
+}
+
+struct QuantizationSettings {
+    DType dtype = DType::BF16;
+    unsigned groupSize = 32;  // Q4
+    bool useOffset = false;   // Q4
+};
+
+// Convert all layer projections from BF16 (the embedding & LM head stay BF16)
+// If `measureError`, returns the worst relative error of any quantized projection
+double quantizeParameters(Model& model, const QuantizationSettings& settings, bool measureError) {
+    double maxError = 0;
+    if (settings.dtype == DType::BF16) return maxError;
+    std::vector<Buffer<char>> quantized;
+    for (auto& layer : model.layers) {
+        forEachProjection(model, layer, [&](Parameter& p, unsigned dIn, unsigned dOut) {
+            auto& storage = quantized.emplace_back();
+            auto q = settings.dtype == DType::I8 ? quantizeI8(p, dIn, dOut, storage)
+                                                 : quantizeQ4(p, dIn, dOut, settings.groupSize,
+                                                              settings.useOffset, storage);
+            if (measureError) {
+                maxError = std::max(maxError, relativeError(p, q, dIn, dOut));
+            }
+            p = q;
+        });
+    }
+    // All derived data was for projections (fused BF16 copies), so has now been replaced
+    model._derivedData = std::move(quantized);
+    return maxError;
+}
+
+// Copy `rows` rows of `rowBytes` into new storage, each pool thread first-touching (so placing
+// on its NUMA node) the rows it reads in project(), which partitions rows with alignment `align`
+const char* placeRows(std::vector<Buffer<char>>& storage,
+                      const void* src,
+                      unsigned rows,
+                      size_t rowBytes,
+                      unsigned align) {
+    auto& dest = storage.emplace_back(allocate<char>(rows * rowBytes));
+    threadPool().run([&](unsigned idx, unsigned count) {
+        auto [j0, j1] = partition(rows, align, idx, count);
+        std::memcpy(dest.get() + j0 * rowBytes, static_cast<const char*>(src) + j0 * rowBytes,
+                    (j1 - j0) * rowBytes);
+    });
+    return dest.get();
+}
+
+// NUMA: copy every projection (including the LM head) so that each thread's rows are local to it
+// Call after quantizeParameters(), and after setThreads(n, numa=true), keeping the same threads
+void placeProjections(Model& model) {
+    std::vector<Buffer<char>> placed;
+    auto place = [&placed](Parameter& p, unsigned dIn, unsigned dOut, unsigned align) {
+        auto rowBytes = p.dtype == DType::BF16 ? dIn * sizeof(bf16)
+                        : p.dtype == DType::I8 ? dIn
+                                               : dIn / 2;
+        auto groupsPerRow = p.dtype == DType::Q4 ? dIn / p.groupSize : 1;
+        p.data = placeRows(placed, p.data, dOut, rowBytes, align);
+        for (auto* groupData : {&p.scale, &p.offset}) {
+            if (*groupData) {
+                *groupData = reinterpret_cast<const float*>(
+                    placeRows(placed, *groupData, dOut, groupsPerRow * sizeof(float), align));
+            }
+        }
+    };
+    for (auto& layer : model.layers) {
+        forEachProjection(model, layer, [&](Parameter& p, unsigned dIn, unsigned dOut) {
+            // projectSwiGlu partitions gate & up in whole blocks
+            auto glu = &p == &layer.mlpGate || &p == &layer.mlpUp;
+            place(p, dIn, dOut, glu ? GluBlock : ProjectAlign);
+        });
+    }
+    place(model.embedTokens, model.dModel, model.dVocab, ProjectAlign);
+    // All derived data was for projections, so has now been replaced
+    model._derivedData = std::move(placed);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Ops
+
+// Ops write into caller-provided buffers (see Workspace), x.shape (nRows, dIn) etc.
+
+// y.shape (len(tokens), dModel)
+void embeddingLookup(std::span<const unsigned> tokens,
+                     const bf16* weight,
+                     unsigned dModel,
+                     float* y) {
+    for (auto n = 0u; n < tokens.size(); ++n) {
+        for (auto i = 0u; i < dModel; ++i) {
+            y[n * dModel + i] = bf16_to_float(weight[tokens[n] * dModel + i]);
+        }
+    }
+}
+
+// y.shape (nRows, dModel) (y may alias x)
+void rmsNorm(const float* x,
+             unsigned nRows,
+             const bf16* weight,
+             unsigned dModel,
+             float eps,
+             float* y) {
+    for (auto i0 = 0u; i0 < nRows * dModel; i0 += dModel) {
+        float sumSq = 0;
+        for (auto i = 0u; i < dModel; ++i) {
+            sumSq += x[i0 + i] * x[i0 + i];
+        }
+        float norm = 1 / (std::sqrt(sumSq / dModel + eps));
+        for (auto i = 0u; i < dModel; ++i) {
+            y[i0 + i] = x[i0 + i] * norm * bf16_to_float(weight[i]);
+        }
+    }
+}
+
+// Below this many rows, packing weights for the blocked GEMM costs more than it saves, so
+// projectRange() instead runs gemv for every row over chunks of GemvBatchChunk output channels,
+// each chunk of weights being read from memory once and reused from cache for the whole batch
+constexpr unsigned GemmMinRows = 16;
+constexpr unsigned GemvBatchChunk = 16;
+
+// x rounded to bf16 into scratch.shape (nRows, dIn), if `kernels` use bf16 activations for
+// `weight` (see Kernels::toBf16), otherwise nullptr
+const bf16* toBf16Activations(const Kernels& kernels,
+                              const float* x,
+                              unsigned nRows,
+                              const Parameter& weight,
+                              unsigned dIn,
+                              bf16* scratch) {
+    if (!kernels.toBf16 || weight.dtype != DType::BF16) return nullptr;
+    threadPool().run([&](unsigned idx, unsigned count) {
+        auto [n0, n1] = partition(nRows, 1, idx, count);
+        kernels.toBf16(x + n0 * dIn, (n1 - n0) * dIn, scratch + n0 * dIn);
+    });
+    return scratch;
+}
+
+// y[n * ldy + j - j0] = x[n, :] . weight[j, :], for j in [j0, j1), on the calling thread
+// xBf16 is x rounded to bf16 (see toBf16Activations), or nullptr
+void projectRange(const Kernels& kernels,
+                  const float* x,
+                  const bf16* xBf16,
+                  unsigned nRows,
+                  const Parameter& weight,
+                  unsigned dIn,
+                  unsigned j0,
+                  unsigned j1,
+                  float* y,
+                  unsigned ldy) {
+    if (j0 == j1) return;
+    if (xBf16 && nRows >= GemmMinRows && dIn % 2 == 0) {
+        kernels.gemmBf16(xBf16, nRows, weight, dIn, j0, j1, y, ldy);
+    } else if (xBf16) {
+        auto chunk = nRows == 1 ? j1 - j0 : GemvBatchChunk;
+        for (auto c0 = j0; c0 < j1; c0 += chunk) {
+            auto c1 = std::min(j1, c0 + chunk);
+            for (auto n = 0u; n < nRows; ++n) {
+                kernels.gemvBf16(xBf16 + n * dIn, weight, dIn, c0, c1, y + n * ldy + (c0 - j0));
+            }
+        }
+    } else if (nRows == 1) {
+        kernels.gemv(x, weight, dIn, j0, j1, y);
+    } else if (nRows < GemmMinRows) {
+        for (auto c0 = j0; c0 < j1; c0 += GemvBatchChunk) {
+            auto c1 = std::min(j1, c0 + GemvBatchChunk);
+            for (auto n = 0u; n < nRows; ++n) {
+                kernels.gemv(x + n * dIn, weight, dIn, c0, c1, y + n * ldy + (c0 - j0));
+            }
+        }
+    } else {
+        kernels.gemm(x, nRows, weight, dIn, j0, j1, y, ldy);
+    }
+}
+
+// y.shape (nRows, dOut), scratch.shape (nRows, dIn) (see toBf16Activations)
+void project(const Kernels& kernels,
+             const float* x,
+             unsigned nRows,
+             const Parameter& weight,
+             unsigned dIn,
+             unsigned dOut,
+             float* y,
+             bf16* scratch) {
+    auto xBf16 = toBf16Activations(kernels, x, nRows, weight, dIn, scratch);
+    threadPool().run([&](unsigned idx, unsigned count) {
+        auto [j0, j1] = partition(dOut, ProjectAlign, idx, count);
+        projectRange(kernels, x, xBf16, nRows, weight, dIn, j0, j1, y + j0, dOut);
+    });
+}
+
+// Fused gate & up projections, then y = up * silu(gate), shape (nRows, dFFN)
+// Each thread computes GluBlock channels of gate & up at a time, reading both weights in place,
+// into its own slice of gateUp.shape (threads, nRows, 2 * GluBlock)
+void projectSwiGlu(const Kernels& kernels,
+                   const float* x,
+                   unsigned nRows,
+                   const Parameter& gateWeight,
+                   const Parameter& upWeight,
+                   unsigned dIn,
+                   unsigned dFFN,
+                   float* gateUp,
+                   float* y,
+                   bf16* scratch) {
+    auto xBf16 = toBf16Activations(kernels, x, nRows, gateWeight, dIn, scratch);
+    threadPool().run([&](unsigned idx, unsigned count) {
+        auto [j0, j1] = partition(dFFN, GluBlock, idx, count);
+        auto block = gateUp + idx * nRows * 2 * GluBlock;
+        for (auto b0 = j0; b0 < j1; b0 += GluBlock) {
+            auto b1 = std::min(j1, b0 + GluBlock);
+            projectRange(kernels, x, xBf16, nRows, gateWeight, dIn, b0, b1, block, 2 * GluBlock);
+            projectRange(kernels, x, xBf16, nRows, upWeight, dIn, b0, b1, block + GluBlock,
+                         2 * GluBlock);
+            for (auto n = 0u; n < nRows; ++n) {
+                auto gate = block + n * 2 * GluBlock;
+                auto up = gate + GluBlock;
+                auto out = y + n * dFFN + b0;
+                for (auto i = 0u; i < b1 - b0; ++i) {
+                    out[i] = up[i] * gate[i] / (1 + std::exp(-gate[i]));
+                }
+            }
+        }
+    });
+}
+
+// Output channels computed at a time by each thread in projectTopK()
+constexpr unsigned TopKChunk = 256;
+
+// (value, index), e.g. (logit, token)
+using Candidate = std::pair<float, unsigned>;
+
+// Order by value descending, then index ascending, so that ties are broken deterministically
+bool candidateBefore(const Candidate& a, const Candidate& b) {
+    return a.first > b.first || (a.first == b.first && a.second < b.second);
+}
+
+// The k largest of y = weight . x, x.shape (dIn), y.shape (dOut), into the first k elements of
+// `top` in candidateBefore() order, without materializing y: each thread keeps a heap of the k best
+// of its channels, computing them TopKChunk at a time. The result is independent of thread count
+void projectTopK(const Kernels& kernels,
+                 const float* x,
+                 const Parameter& weight,
+                 unsigned dIn,
+                 unsigned dOut,
+                 unsigned k,
+                 std::vector<Candidate>& top,
+                 bf16* scratch) {
+    auto xBf16 = toBf16Activations(kernels, x, 1, weight, dIn, scratch);
+    top.assign(threadPool().size() * k, {-INFINITY, 0});
+    threadPool().run([&](unsigned idx, unsigned count) {
+        auto [j0, j1] = partition(dOut, ProjectAlign, idx, count);
+        auto heap = top.begin() + idx * k;
+        float chunk[TopKChunk];
+        for (auto c0 = j0; c0 < j1; c0 += TopKChunk) {
+            auto c1 = std::min(j1, c0 + TopKChunk);
+            projectRange(kernels, x, xBf16, 1, weight, dIn, c0, c1, chunk, c1 - c0);
+            for (auto j = c0; j < c1; ++j) {
+                Candidate candidate{chunk[j - c0], j};
+                if (candidateBefore(candidate, *heap)) {
+                    std::pop_heap(heap, heap + k, candidateBefore);
+                    heap[k - 1] = candidate;
+                    std::push_heap(heap, heap + k, candidateBefore);
+                }
+            }
+        }
+    });
+    std::partial_sort(top.begin(), top.begin() + k, top.end(), candidateBefore);
+}
+
+// Extend model.rope to cover positions [0, length)
+const RopeTable& ropeTable(const Model& model, unsigned length) {
+    auto& rope = model.rope;
+    if (length <= rope.length) {
+        return rope;
+    }
+    length = std::max(length, 2 * rope.length);
+    auto& freq = model.ropeFreq;
+    rope.cos.resize(length * freq.size());
+    rope.sin.resize(length * freq.size());
+    for (auto n = rope.length; n < length; ++n) {
+        for (auto i = 0u; i < freq.size(); ++i) {
+            rope.cos[n * freq.size() + i] = std::cos(freq[i] * n);
+            rope.sin[n * freq.size() + i] = std::sin(freq[i] * n);
+        }
+    }
+    rope.length = length;
+    return rope;
+}
+
+// x.shape (seq, ldx), for positions [start, start + seq)
+// Rotates columns [0, nHeads * dAttnHead) of x into the same columns of y.shape (seq, ldy)
+// (y may alias x)
+void rotate(const Model& model,
+            const float* x,
+            unsigned ldx,
+            unsigned seq,
+            unsigned nHeads,
+            unsigned start,
+            float* y,
+            unsigned ldy) {
+    auto& rope = ropeTable(model, start + seq);
+    unsigned half = model.ropeFreq.size();
+    for (auto n = 0u; n < seq; ++n) {
+        auto cos = rope.cos.data() + (start + n) * half;
+        auto sin = rope.sin.data() + (start + n) * half;
+        for (auto h = 0u; h < nHeads; ++h) {
+            model.kernels.rotate(x + n * ldx + h * 2 * half, cos, sin, half,
+                                 y + n * ldy + h * 2 * half);
+        }
+    }
+}
+
+// Rotates columns [0, nHeads * dAttnHead) of x.shape (seq, ldx) in place
+void rotateInPlace(const Model& model,
+                   float* x,
+                   unsigned ldx,
+                   unsigned seq,
+                   unsigned nHeads,
+                   unsigned start) {
+    rotate(model, x, ldx, seq, nHeads, start, x, ldx);
+}
+
+// Attention tiling: each work item is a block of AttnQueryBlock query positions for a group of
+// query heads sharing one KV head, streaming keys & values in tiles of AttnKeyBlock positions
+// Keys & values are paged in blocks of one tile: position p is row (p % AttnKeyBlock) of block
+// blocks[p / AttnKeyBlock], which starts at offset blocks[...] * blockStride
+constexpr unsigned AttnQueryBlock = 16;
+constexpr unsigned AttnKeyBlock = 64;
+
+// One sequence in a batched selfAttention(): query rows [row0, row0 + seq), for positions
+// [start, start + seq), attending to paged keys & values (see AttnKeyBlock). Each block holds keys
+// at k + offset and values at v + offset, of shape (AttnKeyBlock, dKV, dHead), either as floats,
+// or as int8 with scales at kScale + offset & vScale + offset, of shape (AttnKeyBlock, dKV)
+struct AttentionSegment {
+    unsigned row0;
+    unsigned seq;
+    unsigned start;
+    KVDType dtype;
+    const float* k;
+    const float* v;
+    const float* kScale;  // I8 only
+    const float* vScale;  // I8 only
+    const unsigned* blocks;
+    size_t blockStride;
+};
+
+// Online softmax over keys [k0, k1) of KV head kvHead in `kv`, for nQ consecutive query positions
+// x nH query heads (rows q[r * ldq + h * dHead]), where position r sees keys [0, visible + r).
+// Writes the unnormalized output rows out[r * ldo + h * dHead], and the max score & softmax
+// denominator per row, index r * lds + h (-inf & 0 for rows that see none of the keys)
+// Int8 keys & values are used directly, applying their scales to the scores & softmax weights
+void attendBlock(const Kernels& kernels,
+                 const float* q,
+                 unsigned ldq,
+                 const AttentionSegment& kv,
+                 unsigned kvHead,
+                 unsigned dKV,
+                 unsigned nQ,
+                 unsigned nH,
+                 unsigned visible,
+                 unsigned k0,
+                 unsigned k1,
+                 unsigned dHead,
+                 float* out,
+                 unsigned ldo,
+                 float* maxScore,
+                 float* sum,
+                 unsigned lds) {
+    auto scale = 1 / std::sqrt(static_cast<float>(dHead));
+    auto ldk = dKV * dHead;
+    auto quantized = kv.dtype == KVDType::I8;
+    float scores[AttnKeyBlock];
+    float weights[AttnKeyBlock];
+    for (auto r = 0u; r < nQ; ++r) {
+        for (auto h = 0u; h < nH; ++h) {
+            std::fill(out + r * ldo + h * dHead, out + r * ldo + (h + 1) * dHead, 0.0f);
+            maxScore[r * lds + h] = -INFINITY;
+            sum[r * lds + h] = 0;
+        }
+    }
+    for (auto kt = k0; kt < std::min(k1, visible + nQ - 1); kt += AttnKeyBlock) {
+        auto block = kv.blocks[kt / AttnKeyBlock] * kv.blockStride;
+        auto k = kv.k + block, v = kv.v + block;
+        auto kI8 = reinterpret_cast<const int8_t*>(k) + kvHead * dHead;
+        auto vI8 = reinterpret_cast<const int8_t*>(v) + kvHead * dHead;
+        for (auto r = 0u; r < nQ; ++r) {
+            auto end = std::min(k1, visible + r);
+            if (kt >= end) continue;
+            auto nK = std::min(AttnKeyBlock, end - kt);
+            for (auto h = 0u; h < nH; ++h) {
+                auto state = r * lds + h;
+                auto outRow = out + r * ldo + h * dHead;
+                auto qRow = q + r * ldq + h * dHead;
+                if (quantized) {
+                    kernels.dotRowsI8(qRow, kI8, ldk, nK, dHead, scores);
+                    for (auto t = 0u; t < nK; ++t) scores[t] *= kv.kScale[block + t * dKV + kvHead];
+                } else {
+                    kernels.dotRows(qRow, k + kvHead * dHead, ldk, nK, dHead, scores);
+                }
+                auto tileMax = -INFINITY;
+                for (auto t = 0u; t < nK; ++t) {
+                    scores[t] *= scale;
+                    tileMax = std::max(tileMax, scores[t]);
+                }
+                if (tileMax > maxScore[state]) {
+                    auto correction = std::exp(maxScore[state] - tileMax);
+                    sum[state] *= correction;
+                    for (auto i = 0u; i < dHead; ++i) outRow[i] *= correction;
+                    maxScore[state] = tileMax;
+                }
+                for (auto t = 0u; t < nK; ++t) {
+                    scores[t] = std::exp(scores[t] - maxScore[state]);
+                    sum[state] += scores[t];
+                }
+                if (quantized) {
+                    for (auto t = 0u; t < nK; ++t) {
+                        weights[t] = scores[t] * kv.vScale[block + t * dKV + kvHead];
+                    }
+                    kernels.axpyRowsI8(weights, vI8, ldk, nK, dHead, outRow);
+                } else {
+                    kernels.axpyRows(scores, v + kvHead * dHead, ldk, nK, dHead, outRow);
+                }
+            }
+        }
+    }
+}
+
+// How selfAttention() divides one segment into work items
+struct AttentionPlan {
+    unsigned item0;  // first work item
+    unsigned nQueryBlocks;
+    unsigned nSplit;
+    unsigned splitKeys;
+};
+
+// Scratch for selfAttention: per key split, unnormalized outputs (splitRows, nHeads, dHead), and
+// max scores & softmax denominators (rows, nHeads), rows >= max(seq, splitRows)
+struct AttentionScratch {
+    unsigned splitRows;
+    Activation partial;
+    Activation maxScore;
+    Activation sum;
+    std::vector<AttentionPlan> plans;  // [segment]
+
+    // Key splits only happen when there are fewer work items than threads, i.e. seq is small, in
+    // which case nSplit * seq < 2 * AttnQueryBlock * nThreads
+    AttentionScratch(unsigned maxSeq, unsigned nHeads, unsigned dHead, unsigned nThreads)
+        : splitRows(std::min(maxSeq * nThreads, 2 * AttnQueryBlock * nThreads)),
+          partial(splitRows * nHeads * dHead),
+          maxScore(std::max(maxSeq, splitRows) * nHeads),
+          sum(maxScore.size) {
+        plans.reserve(maxSeq);
+    }
+};
+
+// Causal self-attention, flash-attention style, parallel over (query block, KV head, query head
+// group) work items, latest (longest) query blocks first to balance the causal triangle. Query
+// heads sharing a KV head are grouped to reuse each key tile, unless that leaves threads idle.
+// When there are still fewer work items than threads (e.g. decoding), keys are also split across
+// threads, and the partial results merged (flash-decoding)
+// Independent sequences (segments, in row order) are batched into one pass over the threads
+// q.shape   (seq, ldq), columns [0, dKV * dQ * dHead) holding heads (dKV, dQ, dHead)
+// out.shape (seq, dKV, dQ, dHead)
+void selfAttention(const Kernels& kernels,
+                   const float* q,
+                   unsigned ldq,
+                   std::span<const AttentionSegment> segments,
+                   unsigned dKV,
+                   unsigned dQ,
+                   unsigned dHead,
+                   AttentionScratch& scratch,
+                   float* out) {
+    auto nHeads = dKV * dQ;
+    auto ldo = nHeads * dHead;
+    auto nThreads = threadPool().size();
+    auto dSeq = 0u, nQueryBlocks = 0u;
+    for (auto& segment : segments) {
+        dSeq += segment.seq;
+        nQueryBlocks += (segment.seq + AttnQueryBlock - 1) / AttnQueryBlock;
+    }
+    if (dSeq == 0) return;
+    auto groupSize = nQueryBlocks * dKV >= nThreads ? dQ : 1u;
+    auto nGroups = dKV * dQ / groupSize;
+    auto nItems = nQueryBlocks * nGroups;
+    auto maxSplit = std::min((nThreads + nItems - 1) / nItems, scratch.splitRows / dSeq);
+    maxSplit = std::max(maxSplit, 1u);
+    auto& plans = scratch.plans;
+    plans.clear();
+    auto nWork = 0u;
+    auto anySplit = false;
+    for (auto& segment : segments) {
+        auto nKeyTiles = (segment.start + segment.seq + AttnKeyBlock - 1) / AttnKeyBlock;
+        auto nSplit = std::min(maxSplit, nKeyTiles);
+        auto splitKeys = (nKeyTiles + nSplit - 1) / nSplit * AttnKeyBlock;
+        nSplit = (segment.start + segment.seq + splitKeys - 1) / splitKeys;
+        auto blocks = (segment.seq + AttnQueryBlock - 1) / AttnQueryBlock;
+        plans.push_back({nWork, blocks, nSplit, splitKeys});
+        nWork += blocks * nGroups * nSplit;
+        anySplit |= nSplit > 1;
+    }
+
+    auto partial = scratch.partial.data.get();
+    auto maxScore = scratch.maxScore.data.get();
+    auto sum = scratch.sum.data.get();
+    parallelForDynamic(nWork, [&](unsigned item) {
+        auto it = std::upper_bound(plans.begin(), plans.end(), item,
+                                   [](unsigned i, const AttentionPlan& p) { return i < p.item0; });
+        auto& plan = *(it - 1);
+        auto& segment = segments[it - 1 - plans.begin()];
+        auto local = item - plan.item0;
+        auto nSplit = plan.nSplit;
+        auto qb = plan.nQueryBlocks - 1 - local / (nGroups * nSplit);
+        auto head = local / nSplit % nGroups * groupSize;
+        auto split = local % nSplit;
+        auto sQ0 = qb * AttnQueryBlock;
+        auto nQ = std::min(AttnQueryBlock, segment.seq - sQ0);
+        auto row = segment.row0 + sQ0;
+        auto dest = (nSplit > 1 ? partial + split * dSeq * ldo : out) + row * ldo + head * dHead;
+        auto state = (split * dSeq + row) * nHeads + head;
+        attendBlock(kernels, q + row * ldq + head * dHead, ldq, segment, head / dQ, dKV, nQ,
+                    groupSize, segment.start + sQ0 + 1, split * plan.splitKeys,
+                    (split + 1) * plan.splitKeys, dHead, dest, ldo, maxScore + state,
+                    sum + state, nHeads);
+        if (nSplit == 1) {
+            for (auto r = 0u; r < nQ; ++r) {
+                for (auto h = 0u; h < groupSize; ++h) {
+                    auto outRow = dest + r * ldo + h * dHead;
+                    auto norm = 1 / sum[state + r * nHeads + h];
+                    for (auto i = 0u; i < dHead; ++i) outRow[i] *= norm;
+                }
+            }
+        }
+    });
+    if (anySplit) {
+        parallelFor(dSeq * nHeads, [&](size_t row) {
+            auto it = std::upper_bound(
+                segments.begin(), segments.end(), row / nHeads,
+                [](size_t r, const AttentionSegment& segment) { return r < segment.row0; });
+            auto nSplit = plans[it - 1 - segments.begin()].nSplit;
+            if (nSplit == 1) return;
+            auto globalMax = -INFINITY;
+            for (auto split = 0u; split < nSplit; ++split) {
+                globalMax = std::max(globalMax, maxScore[split * dSeq * nHeads + row]);
+            }
+            auto outRow = out + row * dHead;
+            std::fill(outRow, outRow + dHead, 0.0f);
+            auto total = 0.0f;
+            for (auto split = 0u; split < nSplit; ++split) {
+                auto idx = split * dSeq * nHeads + row;
+                if (sum[idx] == 0) continue;
+                auto weight = std::exp(maxScore[idx] - globalMax);
+                total += weight * sum[idx];
+                kernels.axpyRows(&weight, partial + split * dSeq * ldo + row * dHead, 0, 1, dHead,
+                                 outRow);
+            }
+            auto norm = 1 / total;
+            for (auto i = 0u; i < dHead; ++i) outRow[i] *= norm;
+        });
+    }
+}
+
+void addInPlace(float* lhs, const float* rhs, size_t n) {
+    for (auto i = 0u; i < n; ++i) {
+        lhs[i] += rhs[i];
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Sampling
+
+unsigned argmax(const float* logits, unsigned n) {
+    return std::max_element(logits, logits + n) - logits;
+}
+
+struct SamplerSettings {
+    float temperature = 0;  // 0 for greedy
+    unsigned topK = 0;      // keep the k most likely tokens (0 for all)
+    float topP = 1;         // keep the most likely tokens with total probability >= topP
+    float minP = 0;         // keep tokens with probability >= minP * (top probability)
+    // Penalties for tokens already seen: logits divided (if positive) or multiplied (if
+    // negative) by repetitionPenalty, and presencePenalty subtracted
+    float repetitionPenalty = 1;
+    float presencePenalty = 0;
+    uint64_t seed = 0;
+};
+
+// Tokens less likely than this (log probability relative to the most likely) are dropped before
+// computing exp(), as their total probability is negligible (< 1e-8 even for 128k tokens)
+constexpr float SampleMinLogProb = -30;
+
+// Largest top-k for which the LM head is fused with selection (see nextToken)
+constexpr unsigned FusedTopKMax = 64;
+
+// Chooses each next token from logits, with no full sort: nth_element for top-k (then sorting
+// only those k), and a quickselect on probability mass for top-p, so the cost is O(dVocab)
+struct Sampler {
+    SamplerSettings settings;
+    std::mt19937_64 rng;
+    std::vector<Candidate> candidates;  // (logit, token), capacity dVocab
+    std::vector<float> penalized;       // [dVocab], logits after penalties
+    std::vector<bool> isSeen;           // [dVocab]
+    std::vector<unsigned> seen;         // distinct tokens, for penalties
+
+    Sampler(const SamplerSettings& settings, unsigned dVocab)
+        : settings(settings), rng(settings.seed), isSeen(dVocab) {
+        candidates.reserve(dVocab);
+        penalized.reserve(dVocab);
+    }
+
+    bool hasPenalties() const {
+        return settings.repetitionPenalty != 1 || settings.presencePenalty != 0;
+    }
+
+    // Record a token of the sequence (prompt or generated), for penalties
+    void observe(unsigned token) {
+        if (!isSeen[token]) {
+            isSeen[token] = true;
+            seen.push_back(token);
+        }
+    }
+
+    float penalize(float logit) const {
+        logit = logit > 0 ? logit / settings.repetitionPenalty : logit * settings.repetitionPenalty;
+        return logit - settings.presencePenalty;
+    }
+
+    // If sampling only depends on the k largest logits (small enough to fuse), k, otherwise 0
+    unsigned fusedTopK() const {
+        if (hasPenalties()) return 0;
+        if (settings.temperature <= 0) return 1;
+        return settings.topK <= FusedTopKMax ? settings.topK : 0;
+    }
+
+    // Forget observed tokens after the first n distinct ones, e.g. when rejecting a draft
+    void truncateSeen(size_t n) {
+        for (; seen.size() > n; seen.pop_back()) isSeen[seen.back()] = false;
+    }
+
+    unsigned sample(const float* logits, unsigned n) {
+        logits = applyPenalties(logits, n);
+        if (settings.temperature <= 0) {
+            return argmax(logits, n);
+        }
+        return choose(candidates.begin(), topK(logits, n));
+    }
+
+    // The probability of each token under sample(), into probs[0, n)
+    void distribution(const float* logits, unsigned n, float* probs) {
+        logits = applyPenalties(logits, n);
+        std::fill(probs, probs + n, 0.0f);
+        if (settings.temperature <= 0) {
+            probs[argmax(logits, n)] = 1;
+            return;
+        }
+        auto begin = candidates.begin();
+        auto end = weigh(begin, topK(logits, n));
+        auto total = std::accumulate(begin, end, 0.0f,
+                                     [](float sum, auto& c) { return sum + c.first; });
+        for (auto it = begin; it != end; ++it) probs[it->second] = it->first / total;
+    }
+
+    // Sample from unnormalized probabilities weights[0, n)
+    unsigned draw(const float* weights, unsigned n) {
+        auto total = std::accumulate(weights, weights + n, 0.0f);
+        auto u = std::uniform_real_distribution<float>(0, total)(rng);
+        auto last = 0u;
+        for (auto i = 0u; i < n; ++i) {
+            if (weights[i] <= 0) continue;
+            last = i;
+            u -= weights[i];
+            if (u <= 0) return i;
+        }
+        return last;
+    }
+
+    const float* applyPenalties(const float* logits, unsigned n) {
+        if (!hasPenalties()) return logits;
+        penalized.assign(logits, logits + n);
+        for (auto token : seen) penalized[token] = penalize(penalized[token]);
+        return penalized.data();
+    }
+
+    // Fill candidates with (logit, token), returning the end of the top-k, which are in
+    // candidateBefore() order (as from projectTopK())
+    std::vector<Candidate>::iterator topK(const float* logits, unsigned n) {
+        candidates.resize(n);
+        for (auto i = 0u; i < n; ++i) candidates[i] = {logits[i], i};
+        auto end = candidates.end();
+        if (settings.topK && settings.topK < n) {
+            end = candidates.begin() + settings.topK;
+            std::nth_element(candidates.begin(), end - 1, candidates.end(), candidateBefore);
+            std::sort(candidates.begin(), end, candidateBefore);
+        }
+        return end;
+    }
+
+    // Sample from (logit, token) candidates, after top-k (modifies the candidates)
+    unsigned choose(std::vector<Candidate>::iterator begin, std::vector<Candidate>::iterator end) {
+        auto greater = [](const auto& a, const auto& b) { return a.first > b.first; };
+        if (settings.temperature <= 0) {
+            return std::min_element(begin, end, greater)->second;
+        }
+        end = weigh(begin, end);
+        auto total = std::accumulate(begin, end, 0.0f,
+                                     [](float sum, auto& c) { return sum + c.first; });
+        auto u = std::uniform_real_distribution<float>(0, total)(rng);
+        for (auto it = begin; it != end; ++it) {
+            u -= it->first;
+            if (u <= 0) return it->second;
+        }
+        return (end - 1)->second;
+    }
+
+    // Replace logits by unnormalized probabilities (temperature), dropping candidates excluded by
+    // min-p & top-p, returning the new end
+    std::vector<Candidate>::iterator weigh(std::vector<Candidate>::iterator begin,
+                                           std::vector<Candidate>::iterator end) {
+        auto greater = [](const auto& a, const auto& b) { return a.first > b.first; };
+
+        // Min-p, in log probability relative to the max
+        auto max = std::min_element(begin, end, greater)->first;
+        auto threshold = std::max(SampleMinLogProb, std::log(settings.minP));
+        end = std::partition(begin, end, [&](auto& c) {
+            c.first = (c.first - max) / settings.temperature;
+            return c.first >= threshold;
+        });
+        auto total = 0.0f;
+        for (auto it = begin; it != end; ++it) {
+            it->first = std::exp(it->first);
+            total += it->first;
+        }
+
+        // Top-p: partition [begin, end) until the most likely tokens with total >= target are in
+        // [begin, last), where `before` is the total of [begin, first)
+        if (settings.topP < 1) {
+            auto target = settings.topP * total, before = 0.0f;
+            auto first = begin, last = end;
+            while (last - first > 1) {
+                auto pivot = first[(last - first) / 2].first;
+                auto mid =
+                    std::partition(first, last, [pivot](auto& c) { return c.first > pivot; });
+                auto above = std::accumulate(first, mid, 0.0f,
+                                             [](float sum, auto& c) { return sum + c.first; });
+                if (before + above >= target) {
+                    last = mid;
+                    continue;
+                }
+                before += above;
+                first = std::partition(mid, last, [pivot](auto& c) { return c.first == pivot; });
+                before += std::accumulate(mid, first, 0.0f,
+                                          [](float sum, auto& c) { return sum + c.first; });
+                if (before >= target) {
+                    last = first;
+                }
+            }
+            end = last;
+        }
+        return end;
+    }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Model ops
+
+// Positions per KV cache block: one attention key tile, so that tiles never straddle blocks
+constexpr unsigned KVBlockSize = AttnKeyBlock;
+
+unsigned kvBlocksFor(unsigned positions) {
+    return (positions + KVBlockSize - 1) / KVBlockSize;
+}
+
+// Floats per layer of a KV cache block (int8 values are packed four to a float)
+size_t kvLayerFloats(const Model& model) {
+    auto dKV = model.dAttnKV * model.dAttnHead;
+    if (model.kvDType == KVDType::I8) {
+        return 2 * (KVBlockSize * dKV / 4 + KVBlockSize * model.dAttnKV);
+    }
+    return 2 * KVBlockSize * dKV;
+}
+
+size_t kvBlockBytes(const Model& model) {
+    return model.nLayers * kvLayerFloats(model) * sizeof(float);
+}
+
+// Fixed-size blocks of KV cache memory shared by many sequences (see KVCache), with a free list,
+// and reference counts so that sequences can share full blocks (see PrefixCache), which are never
+// written once shared
+// Each block holds, for each layer, keys then values, shape (KVBlockSize, dAttnKV, dAttnHead),
+// stored as model.kvDType, then for int8 the key & value scales, shape (KVBlockSize, dAttnKV)
+struct KVPool {
+    KVDType dtype;
+    unsigned nKV;        // dAttnKV
+    unsigned dKV;        // dAttnKV * dAttnHead
+    size_t layerStride;  // floats per layer of a block
+    size_t blockStride;  // floats per block
+    unsigned nBlocks;    // allocated
+    unsigned maxBlocks;
+    Activation data;                 // (nBlocks, blockStride)
+    std::vector<unsigned> refCount;  // [block]
+    std::vector<unsigned> freeBlocks;
+
+    // Starts with `initialBlocks`, growing on demand up to `maxBlocks` (by reallocating, so block
+    // addresses are only stable between calls to acquire())
+    KVPool(const Model& model,
+           unsigned initialBlocks,
+           unsigned maxBlocks = std::numeric_limits<unsigned>::max())
+        : dtype(model.kvDType),
+          nKV(model.dAttnKV),
+          dKV(model.dAttnKV * model.dAttnHead),
+          layerStride(kvLayerFloats(model)),
+          blockStride(model.nLayers * layerStride),
+          nBlocks(0),
+          maxBlocks(maxBlocks),
+          data(0) {
+        grow(std::max(initialBlocks, 1u));
+    }
+
+    unsigned available() const { return freeBlocks.size() + (maxBlocks - nBlocks); }
+    unsigned used() const { return nBlocks - freeBlocks.size(); }
+
+    unsigned acquire() {
+        if (freeBlocks.empty()) {
+            if (nBlocks == maxBlocks) {
+                throw std::runtime_error(
+                    std::format("KV cache pool exhausted, all {} blocks in use", maxBlocks));
+            }
+            grow(std::min<size_t>(maxBlocks, 2 * size_t(nBlocks)));
+        }
+        auto block = freeBlocks.back();
+        freeBlocks.pop_back();
+        refCount[block] = 1;
+        return block;
+    }
+    void retain(unsigned block) { ++refCount[block]; }
+    void release(unsigned block) {
+        if (--refCount[block] == 0) freeBlocks.push_back(block);
+    }
+
+    float* block(unsigned block) { return data.data.get() + block * blockStride; }
+    float* k(unsigned block, unsigned layer) { return this->block(block) + layer * layerStride; }
+    float* v(unsigned block, unsigned layer) {
+        return k(block, layer) + KVBlockSize * dKV / (dtype == KVDType::I8 ? 4 : 1);
+    }
+    float* kScale(unsigned block, unsigned layer) {
+        return v(block, layer) + KVBlockSize * dKV / 4;
+    }
+    float* vScale(unsigned block, unsigned layer) {
+        return kScale(block, layer) + KVBlockSize * nKV;
+    }
+
+    void grow(unsigned n) {
+        Activation grown(n * blockStride);
+        std::copy(data.data.get(), data.data.get() + nBlocks * blockStride, grown.data.get());
+        data = std::move(grown);
+        refCount.resize(n, 0);
+        freeBlocks.reserve(n);
+        for (auto b = n; b-- > nBlocks;) freeBlocks.push_back(b);
+        nBlocks = n;
+    }
+};
+
+// Post-RoPE keys and values for every layer, for all positions processed so far
+// Paged: position p is row p % KVBlockSize of block blocks[p / KVBlockSize] in `pool`
+struct KVCache {
+    std::shared_ptr<KVPool> pool;
+    unsigned length;
+    std::vector<unsigned> blocks;
+
+    explicit KVCache(std::shared_ptr<KVPool> pool) : pool(std::move(pool)), length(0) {}
+
+    // With a private pool, grown on demand
+    KVCache(const Model& model, unsigned initialCapacity)
+        : KVCache(std::make_shared<KVPool>(model, kvBlocksFor(initialCapacity))) {
+        blocks.reserve(kvBlocksFor(initialCapacity));
+    }
+
+    KVCache(KVCache&& other) noexcept
+        : pool(std::move(other.pool)), length(other.length), blocks(std::move(other.blocks)) {
+        other.length = 0;
+        other.blocks.clear();
+    }
+    KVCache& operator=(KVCache&& other) noexcept {
+        clear();
+        pool = std::move(other.pool);
+        length = std::exchange(other.length, 0);
+        blocks = std::move(other.blocks);
+        other.blocks.clear();
+        return *this;
+    }
+    ~KVCache() { clear(); }
+
+    // Blocks that reserve(n) would take from the pool
+    unsigned blocksNeeded(unsigned n) const {
+        auto total = kvBlocksFor(length + n);
+        return total > blocks.size() ? total - blocks.size() : 0;
+    }
+
+    // Ensure there is space for `n` more positions, taking blocks from the pool
+    void reserve(unsigned n) {
+        while (blocks.size() < kvBlocksFor(length + n)) blocks.push_back(pool->acquire());
+    }
+
+    // Drop positions from n onwards (e.g. rejected draft tokens), returning unused blocks
+    void truncate(unsigned n) {
+        length = std::min(length, n);
+        for (; blocks.size() > kvBlocksFor(length); blocks.pop_back()) pool->release(blocks.back());
+    }
+
+    // Return all blocks to the pool
+    void clear() {
+        if (pool) {
+            for (auto block : blocks) pool->release(block);
+        }
+        blocks.clear();
+        length = 0;
+    }
+};
+
+// Orders token sequences lexicographically
+struct TokensLess {
+    using is_transparent = void;
+    bool operator()(std::span<const unsigned> a, std::span<const unsigned> b) const {
+        return std::lexicographical_compare(a.begin(), a.end(), b.begin(), b.end());
+    }
+};
+
+// One full KV cache block of a cached prefix, keyed by its KVBlockSize tokens
+struct PrefixNode {
+    std::vector<unsigned> tokens;
+    unsigned block;
+    unsigned depth;  // in blocks
+    uint64_t lastUsed;
+    PrefixNode* parent;
+    std::map<std::span<const unsigned>, std::unique_ptr<PrefixNode>, TokensLess> children;
+};
+
+// Keys & values of previously computed prompt prefixes, so that requests sharing a prefix (e.g. a
+// system prompt) only compute the rest: a radix tree over token IDs at block granularity, each
+// node holding one full block of `pool`, shared by reference count and never written
+// Holds up to maxBlocks blocks, evicting least-recently-used leaves (a node is never used more
+// recently than its descendants, so the LRU node, deepest first, is always a leaf)
+struct PrefixCache {
+    std::shared_ptr<KVPool> pool;
+    unsigned maxBlocks;
+    PrefixNode root;
+    unsigned size;
+    uint64_t clock;
+    std::set<std::tuple<uint64_t, int, PrefixNode*>> lru;  // (lastUsed, -depth, node)
+
+    PrefixCache(std::shared_ptr<KVPool> pool, unsigned maxBlocks)
+        : pool(std::move(pool)), maxBlocks(maxBlocks), root{}, size(0), clock(0) {}
+    ~PrefixCache() {
+        while (size) evict();
+    }
+
+    // A cache holding the longest cached prefix of `tokens`, of at most maxLength positions
+    KVCache lookup(std::span<const unsigned> tokens, unsigned maxLength) {
+        KVCache cache(pool);
+        ++clock;
+        auto node = &root;
+        for (auto b = 0u; (b + 1) * KVBlockSize <= std::min<size_t>(tokens.size(), maxLength);
+             ++b) {
+            auto child = node->children.find(tokens.subspan(b * KVBlockSize, KVBlockSize));
+            if (child == node->children.end()) break;
+            node = child->second.get();
+            touch(node);
+            pool->retain(node->block);
+            cache.blocks.push_back(node->block);
+            cache.length += KVBlockSize;
+        }
+        return cache;
+    }
+
+    // Add the full blocks of `cache`, which holds `tokens`
+    void insert(std::span<const unsigned> tokens, const KVCache& cache) {
+        if (!maxBlocks) return;
+        ++clock;
+        auto node = &root;
+        for (auto b = 0u; b < std::min<size_t>(tokens.size(), cache.length) / KVBlockSize; ++b) {
+            auto key = tokens.subspan(b * KVBlockSize, KVBlockSize);
+            auto child = node->children.find(key);
+            if (child == node->children.end()) {
+                auto added = std::make_unique<PrefixNode>(
+                    PrefixNode{{key.begin(), key.end()}, cache.blocks[b], b + 1, 0, node, {}});
+                pool->retain(added->block);
+                ++size;
+                child = node->children.emplace(added->tokens, std::move(added)).first;
+            }
+            node = child->second.get();
+            touch(node);
+        }
+        while (size > maxBlocks) evict();
+    }
+
+    // Evict until `n` more blocks are free in the pool (those still used by a sequence are only
+    // freed when it finishes), or the cache is empty
+    void evictFor(unsigned n) {
+        while (size && pool->available() < n) evict();
+    }
+
+    void evict() {
+        auto node = std::get<2>(*lru.begin());
+        lru.erase(lru.begin());
+        pool->release(node->block);
+        --size;
+        auto& siblings = node->parent->children;
+        siblings.erase(siblings.find(std::span<const unsigned>(node->tokens)));
+    }
+
+    void touch(PrefixNode* node) {
+        if (node->lastUsed) lru.erase({node->lastUsed, -int(node->depth), node});
+        node->lastUsed = clock;
+        lru.emplace(node->lastUsed, -int(node->depth), node);
+    }
+};
+
+// A run of new tokens for one sequence, continuing the sequence held in `cache`, in a batched
+// forward pass
+struct Segment {
+    KVCache* cache;
+    std::span<const unsigned> tokens;
+    bool logits = true;  // run the LM head on the last position (see forward())
+};
+
+// Largest input dimension of any projection
+unsigned maxProjectionIn(const Model& model) {
+    return std::max({model.dModel, model.dAttnKV * model.dAttnQ * model.dAttnHead, model.dFFN});
+}
+
+// Preallocated activations for forward(), for up to maxSeq positions at a time (and logits for up
+// to maxLogitRows of them), so that steady state decoding doesn't allocate
+struct Workspace {
+    unsigned maxSeq;
+    unsigned maxLogitRows;
+    Activation hidden;   // (maxSeq, dModel), residual stream
+    Activation norm;     // (maxSeq, dModel)
+    Activation qkv;      // (maxSeq, dQKV)
+    Activation mix;      // (maxSeq, dAttnKV * dAttnQ * dAttnHead)
+    Activation gateUp;   // (threads, maxSeq, 2 * GluBlock), see projectSwiGlu()
+    Activation ffn;      // (maxSeq, dFFN)
+    Activation out;      // (maxSeq, dModel), attention or MLP output
+    Activation logits;   // (maxLogitRows, dVocab)
+    Buffer<bf16> xBf16;  // (maxSeq, maxProjectionIn), if kernels.toBf16
+    AttentionScratch attention;
+    std::vector<AttentionSegment> attentionSegments;
+
+    Workspace(const Model& model, unsigned maxSeq, unsigned maxLogitRows = 1)
+        : maxSeq(maxSeq),
+          maxLogitRows(maxLogitRows),
+          hidden(maxSeq * model.dModel),
+          norm(maxSeq * model.dModel),
+          qkv(maxSeq * (model.dAttnQ + 2) * model.dAttnKV * model.dAttnHead),
+          mix(maxSeq * model.dAttnKV * model.dAttnQ * model.dAttnHead),
+          gateUp(threadPool().size() * maxSeq * 2 * GluBlock),
+          ffn(maxSeq * model.dFFN),
+          out(maxSeq * model.dModel),
+          logits(maxLogitRows * model.dVocab),
+          xBf16(allocate<bf16>(model.kernels.toBf16 ? std::max(maxSeq, maxLogitRows) *
+                                                          maxProjectionIn(model)
+                                                    : 0)),
+          attention(maxSeq,
+                    model.dAttnKV * model.dAttnQ,
+                    model.dAttnHead,
+                    threadPool().size()) {
+        attentionSegments.reserve(maxSeq);
+    }
+};
+
+// Symmetric int8 quantization of x[0, n) into q, x[i] ~= scale * q[i], returning the scale
+float quantizeI8(const float* x, unsigned n, int8_t* q) {
+    float absMax = 0;
+    for (auto i = 0u; i < n; ++i) absMax = std::max(absMax, std::abs(x[i]));
+    auto scale = absMax ? absMax / 127 : 1;
+    for (auto i = 0u; i < n; ++i) q[i] = static_cast<int8_t>(std::lround(x[i] / scale));
+    return scale;
+}
+
+// Attention for the new positions of each segment, from ws.hidden into ws.out, writing their keys
+// and values into the segment's cache (without updating cache.length)
+void attention(const Model& model,
+               const Layer& layer,
+               std::span<const Segment> segments,
+               unsigned seq,
+               unsigned layerIdx,
+               Workspace& ws) {
+    auto& kernels = model.kernels;
+    auto dQ = model.dAttnKV * model.dAttnQ * model.dAttnHead;
+    auto dKV = model.dAttnKV * model.dAttnHead;
+    auto dQKV = dQ + 2 * dKV;
+    auto qkv = ws.qkv.data.get();
+    rmsNorm(ws.hidden.data.get(), seq, layer.attnNorm.get_bf16(), model.dModel, model.normEps,
+            ws.norm.data.get());
+    project(kernels, ws.norm.data.get(), seq, layer.attnQKV, model.dModel, dQKV, qkv,
+            ws.xBf16.get());
+
+    // Rotate q in place, and write rotated k & v directly into the cache's blocks
+    auto& parts = ws.attentionSegments;
+    parts.clear();
+    auto row0 = 0u;
+    for (auto& segment : segments) {
+        auto& cache = *segment.cache;
+        auto& pool = *cache.pool;
+        unsigned n = segment.tokens.size();
+        auto x = qkv + row0 * dQKV;
+        rotateInPlace(model, x, dQKV, n, model.dAttnKV * model.dAttnQ, cache.length);
+        for (auto i = 0u; i < n;) {
+            auto position = cache.length + i;
+            auto block = cache.blocks[position / KVBlockSize];
+            auto offset = position % KVBlockSize;
+            auto count = std::min(n - i, KVBlockSize - offset);
+            auto xi = x + i * dQKV;
+            if (pool.dtype == KVDType::I8) {
+                rotate(model, xi + dQ, dQKV, count, model.dAttnKV, position, xi + dQ, dQKV);
+                auto k = reinterpret_cast<int8_t*>(pool.k(block, layerIdx));
+                auto v = reinterpret_cast<int8_t*>(pool.v(block, layerIdx));
+                for (auto t = 0u; t < count; ++t) {
+                    auto xk = xi + t * dQKV + dQ;
+                    for (auto h = 0u; h < model.dAttnKV; ++h) {
+                        auto idx = (offset + t) * model.dAttnKV + h;
+                        auto col = h * model.dAttnHead;
+                        pool.kScale(block, layerIdx)[idx] = quantizeI8(
+                            xk + col, model.dAttnHead, k + (offset + t) * dKV + col);
+                        pool.vScale(block, layerIdx)[idx] = quantizeI8(
+                            xk + dKV + col, model.dAttnHead, v + (offset + t) * dKV + col);
+                    }
+                }
+            } else {
+                rotate(model, xi + dQ, dQKV, count, model.dAttnKV, position,
+                       pool.k(block, layerIdx) + offset * dKV, dKV);
+                for (auto t = 0u; t < count; ++t) {
+                    auto xv = xi + t * dQKV + dQ + dKV;
+                    std::copy(xv, xv + dKV, pool.v(block, layerIdx) + (offset + t) * dKV);
+                }
+            }
+            i += count;
+        }
+        auto quantized = pool.dtype == KVDType::I8;
+        parts.push_back({row0, n, cache.length, pool.dtype, pool.k(0, layerIdx),
+                         pool.v(0, layerIdx), quantized ? pool.kScale(0, layerIdx) : nullptr,
+                         quantized ? pool.vScale(0, layerIdx) : nullptr, cache.blocks.data(),
+                         pool.blockStride});
+        row0 += n;
+    }
+    selfAttention(kernels, qkv, dQKV, parts, model.dAttnKV, model.dAttnQ, model.dAttnHead,
+                  ws.attention, ws.mix.data.get());
+    project(kernels, ws.mix.data.get(), seq, layer.attnO, dQ, model.dModel, ws.out.data.get(),
+            ws.xBf16.get());
+}
+
+// MLP from ws.hidden into ws.out
+void mlp(const Model& model, const Layer& layer, unsigned seq, Workspace& ws) {
+    rmsNorm(ws.hidden.data.get(), seq, layer.mlpNorm.get_bf16(), model.dModel, model.normEps,
+            ws.norm.data.get());
+    projectSwiGlu(model.kernels, ws.norm.data.get(), seq, layer.mlpGate, layer.mlpUp,
+                  model.dModel, model.dFFN, ws.gateUp.data.get(), ws.ffn.data.get(),
+                  ws.xBf16.get());
+    project(model.kernels, ws.ffn.data.get(), seq, layer.mlpDown, model.dFFN, model.dModel,
+            ws.out.data.get(), ws.xBf16.get());
+}
+
+// Run a batch of segments through the model together, each extending its own cache, so that each
+// weight is read once for the whole batch
+// Leaves final (normalized) hidden states in ws.hidden, shape (sum(len(tokens)), dModel), with
+// the rows of each segment in order
+void forwardHidden(const Model& model, std::span<const Segment> segments, Workspace& ws) {
+    auto seq = 0u;
+    for (auto& segment : segments) seq += segment.tokens.size();
+    if (seq > ws.maxSeq) {
+        throw std::invalid_argument(std::format(
+            "forward() of {} tokens, exceeds workspace maxSeq {}", seq, ws.maxSeq));
+    }
+    auto hidden = ws.hidden.data.get();
+    auto row0 = 0u;
+    for (auto& segment : segments) {
+        segment.cache->reserve(segment.tokens.size());
+        embeddingLookup(segment.tokens, model.embedTokens.get_bf16(), model.dModel,
+                        hidden + row0 * model.dModel);
+        row0 += segment.tokens.size();
+    }
+    for (auto idx = 0u; idx < model.nLayers; ++idx) {
+        auto& layer = model.layers[idx];
+        attention(model, layer, segments, seq, idx, ws);
+        addInPlace(hidden, ws.out.data.get(), seq * model.dModel);
+        mlp(model, layer, seq, ws);
+        addInPlace(hidden, ws.out.data.get(), seq * model.dModel);
+    }
+    for (auto& segment : segments) segment.cache->length += segment.tokens.size();
+    rmsNorm(hidden, seq, model.finalNorm.get_bf16(), model.dModel, model.normEps, hidden);
+}
+
+// Run `tokens` through the model, continuing the sequence held in `cache` (which is extended)
+// Leaves final (normalized) hidden states in ws.hidden, shape (len(tokens), dModel)
+void forwardHidden(const Model& model,
+                   KVCache& cache,
+                   std::span<const unsigned> tokens,
+                   Workspace& ws) {
+    Segment segment{&cache, tokens};
+    forwardHidden(model, {&segment, 1}, ws);
+}
+
+// As forwardHidden(), then run the LM head on the last `logitRows` positions only
+// Returns logits in `ws`, shape (logitRows, dVocab)
+const float* forward(const Model& model,
+                     KVCache& cache,
+                     std::span<const unsigned> tokens,
+                     Workspace& ws,
+                     unsigned logitRows = 1) {
+    logitRows = std::min<unsigned>(logitRows, tokens.size());
+    if (logitRows > ws.maxLogitRows) {
+        throw std::invalid_argument(std::format(
+            "forward() of {} logit rows, exceeds workspace maxLogitRows {}", logitRows,
+            ws.maxLogitRows));
+    }
+    forwardHidden(model, cache, tokens, ws);
+    auto hidden = ws.hidden.data.get() + (tokens.size() - logitRows) * model.dModel;
+    project(model.kernels, hidden, logitRows, model.embedTokens, model.dModel, model.dVocab,
+            ws.logits.data.get(), ws.xBf16.get());
+    return ws.logits.data.get();
+}
+
+// As forwardHidden() for a batch of segments, then run the LM head on the last position of each
+// segment with `logits` set
+// Returns logits in `ws`, shape (count(segment.logits), dVocab), in segment order
+const float* forward(const Model& model, std::span<const Segment> segments, Workspace& ws) {
+    auto nLogits = std::count_if(segments.begin(), segments.end(),
+                                 [](const Segment& segment) { return segment.logits; });
+    if (nLogits > ws.maxLogitRows) {
+        throw std::invalid_argument(std::format(
+            "forward() of {} logit rows, exceeds workspace maxLogitRows {}", nLogits,
+            ws.maxLogitRows));
+    }
+    forwardHidden(model, segments, ws);
+    // Gather the last row of each segment (ws.norm is free after forwardHidden)
+    auto last = ws.norm.data.get();
+    auto row = 0u, n = 0u;
+    for (auto& segment : segments) {
+        row += segment.tokens.size();
+        if (!segment.logits) continue;
+        auto x = ws.hidden.data.get() + (row - 1) * model.dModel;
+        std::copy(x, x + model.dModel, last + n++ * model.dModel);
+    }
+    if (n) {
+        project(model.kernels, last, n, model.embedTokens, model.dModel, model.dVocab,
+                ws.logits.data.get(), ws.xBf16.get());
+    }
+    return ws.logits.data.get();
+}
+
+// Choose the next token after final hidden state x.shape (dModel)
+// When the sampler only needs the top k logits (greedy, or small top-k without penalties), the LM
+// head is fused with selection (projectTopK), so full logits are never materialized
+unsigned nextToken(const Model& model, Sampler& sampler, const float* x, Workspace& ws) {
+    auto k = sampler.fusedTopK();
+    if (k && k * threadPool().size() <= model.dVocab) {
+        projectTopK(model.kernels, x, model.embedTokens, model.dModel, model.dVocab, k,
+                    sampler.candidates, ws.xBf16.get());
+        return sampler.choose(sampler.candidates.begin(), sampler.candidates.begin() + k);
+    }
+    project(model.kernels, x, 1, model.embedTokens, model.dModel, model.dVocab,
+            ws.logits.data.get(), ws.xBf16.get());
+    return sampler.sample(ws.logits.data.get(), model.dVocab);
+}
+
+// A cache with space for `capacity` positions, already holding the longest cached prefix of
+// `tokens` if given a prefixCache (leaving at least one token to run, for its logits)
+KVCache startCache(const Model& model,
+                   std::span<const unsigned> tokens,
+                   unsigned capacity,
+                   PrefixCache* prefixCache) {
+    if (tokens.empty()) {
+        throw std::invalid_argument("Prompt must not be empty");
+    }
+    auto cache = prefixCache ? prefixCache->lookup(tokens, tokens.size() - 1)
+                             : KVCache(model, capacity);
+    cache.blocks.reserve(kvBlocksFor(capacity));
+    return cache;
+}
+
+void predict(const Model& model,
+             const std::vector<unsigned>& tokens,
+             const SamplerSettings& sampling,
+             PrefixCache* prefixCache = nullptr) {
+    auto timer = Stopwatch();
+    auto cache = startCache(model, tokens, tokens.size(), prefixCache);
+    auto rest = std::span(tokens).subspan(cache.length);
+    Workspace ws(model, rest.size());
+    Sampler sampler(sampling, model.dVocab);
+    for (auto token : tokens) sampler.observe(token);
+    forwardHidden(model, cache, rest, ws);
+    if (prefixCache) prefixCache->insert(tokens, cache);
+    auto last = ws.hidden.data.get() + (rest.size() - 1) * model.dModel;
+    auto token = nextToken(model, sampler, last, ws);
+    std::cout << token << " in " << timer.elapsed() << " s" << std::endl;
+}
+
+// Compare logits for every position of `tokens` against a reference (e.g. unquantized) model
+void checkAgainstReference(const Model& reference,
+                           const Model& model,
+                           const std::vector<unsigned>& tokens) {
+    KVCache referenceCache(reference, tokens.size()), cache(model, tokens.size());
+    Workspace referenceWs(reference, tokens.size(), tokens.size());
+    Workspace ws(model, tokens.size(), tokens.size());
+    auto referenceLogits = forward(reference, referenceCache, tokens, referenceWs, tokens.size());
+    auto logits = forward(model, cache, tokens, ws, tokens.size());
+    double sumSqErr = 0, sumSqRef = 0;
+    for (auto i = 0u; i < tokens.size() * model.dVocab; ++i) {
+        auto err = logits[i] - referenceLogits[i];
+        sumSqErr += err * err;
+        sumSqRef += referenceLogits[i] * referenceLogits[i];
+    }
+    auto agree = 0u;
+    for (auto n = 0u; n < tokens.size(); ++n) {
+        auto offset = n * model.dVocab;
+        agree += argmax(logits + offset, model.dVocab) ==
+                 argmax(referenceLogits + offset, model.dVocab);
+    }
+    std::cout << std::format("logits relative error {:.4f}, top-1 agreement {}/{}",
+                             std::sqrt(sumSqErr / sumSqRef), agree, tokens.size())
+              << std::endl;
+}
+
+struct GenerateStats {
+    double timeToFirstToken;
+    std::vector<double> tokenLatency;  // time for each token after the first
+    unsigned cachedPrompt = 0;         // prompt tokens found in the prefix cache
+    unsigned drafted = 0;              // speculative decoding: draft tokens proposed
+    unsigned accepted = 0;             // and accepted
+};
+
+// Extend `prompt` by up to `maxNewTokens`, stopping after any token in `stopTokens`
+// `onToken` is called as soon as each new token is selected
+// With a prefixCache, starts from the longest cached prefix of the prompt, then adds the prompt
+GenerateStats generate(const Model& model,
+                       const std::vector<unsigned>& prompt,
+                       unsigned maxNewTokens,
+                       const std::set<unsigned>& stopTokens,
+                       const SamplerSettings& sampling,
+                       const std::function<void(unsigned)>& onToken,
+                       PrefixCache* prefixCache = nullptr) {
+    GenerateStats stats{0, {}};
+    if (maxNewTokens == 0) return stats;
+    auto timer = Stopwatch();
+    auto cache = startCache(model, prompt, prompt.size() + maxNewTokens, prefixCache);
+    auto rest = std::span(prompt).subspan(cache.length);
+    stats.cachedPrompt = cache.length;
+    Workspace ws(model, rest.size());
+    ropeTable(model, prompt.size() + maxNewTokens);
+    stats.tokenLatency.reserve(maxNewTokens);
+    Sampler sampler(sampling, model.dVocab);
+    sampler.seen.reserve(prompt.size() + maxNewTokens);
+    for (auto token : prompt) sampler.observe(token);
+    forwardHidden(model, cache, rest, ws);
+    if (prefixCache) prefixCache->insert(prompt, cache);
+    auto last = ws.hidden.data.get() + (rest.size() - 1) * model.dModel;
+    auto token = nextToken(model, sampler, last, ws);
+    sampler.observe(token);
+    stats.timeToFirstToken = timer.elapsed();
+    onToken(token);
+    for (auto n = 1u; n < maxNewTokens && !stopTokens.contains(token); ++n) {
+        timer = Stopwatch();
+        forwardHidden(model, cache, {&token, 1}, ws);
+        token = nextToken(model, sampler, ws.hidden.data.get(), ws);
+        sampler.observe(token);
+        stats.tokenLatency.push_back(timer.elapsed());
+        onToken(token);
+    }
+    return stats;
+}
+
+std::ostream& operator<<(std::ostream& out, const GenerateStats& stats) {
+    out << std::format("TTFT {:.1f} ms", 1e3 * stats.timeToFirstToken);
+    if (stats.cachedPrompt) out << std::format(" ({} prompt tokens cached)", stats.cachedPrompt);
+    if (!stats.tokenLatency.empty()) {
+        auto sorted = stats.tokenLatency;
+        std::sort(sorted.begin(), sorted.end());
+        auto mean = std::accumulate(sorted.begin(), sorted.end(), 0.0) / sorted.size();
+        out << std::format(", per-token mean {:.1f} ms, median {:.1f} ms, max {:.1f} ms",
+                           1e3 * mean, 1e3 * sorted[sorted.size() / 2], 1e3 * sorted.back())
+            << std::format(" ({} tokens)", sorted.size());
+    }
+    if (stats.drafted) {
+        out << std::format(", {}/{} draft tokens accepted ({:.0f}%)", stats.accepted,
+                           stats.drafted, 100.0 * stats.accepted / stats.drafted);
+    }
+    return out;
+}
+
+// As generate(), with speculative decoding: each round, the (small, fast) `draft` model proposes
+// up to draftTokens tokens one at a time, then `model` runs them all in one forward pass, and each
+// is accepted with probability min(1, p / q), for p & q the probability of the token under the
+// model & draft. The first rejected token is resampled from max(0, p - q) (normalized), or if
+// all are accepted, one more token is sampled from the model. Generated tokens are distributed
+// exactly as by generate(), and each round adds between 1 and draftTokens + 1 tokens
+// Both caches are rolled back to drop rejected positions
+GenerateStats generateSpeculative(const Model& model,
+                                  const Model& draft,
+                                  unsigned draftTokens,
+                                  const std::vector<unsigned>& prompt,
+                                  unsigned maxNewTokens,
+                                  const std::set<unsigned>& stopTokens,
+                                  const SamplerSettings& sampling,
+                                  const std::function<void(unsigned)>& onToken) {
+    if (prompt.empty()) {
+        throw std::invalid_argument("Prompt must not be empty");
+    }
+    if (draft.dVocab != model.dVocab) {
+        throw std::invalid_argument(std::format(
+            "Draft model vocabulary ({}) differs from the model's ({})", draft.dVocab,
+            model.dVocab));
+    }
+    GenerateStats stats{0, {}};
+    if (maxNewTokens == 0) return stats;
+    auto timer = Stopwatch();
+    auto dVocab = model.dVocab;
+    auto capacity = prompt.size() + maxNewTokens + draftTokens;
+    KVCache cache(model, capacity), draftCache(draft, capacity);
+    Workspace ws(model, std::max<unsigned>(prompt.size(), draftTokens + 1), draftTokens + 1);
+    Workspace draftWs(draft, std::max<unsigned>(prompt.size(), 2));
+    ropeTable(model, capacity);
+    ropeTable(draft, capacity);
+    stats.tokenLatency.reserve(maxNewTokens);
+    Sampler sampler(sampling, dVocab), draftSampler(sampling, dVocab);
+    draftSampler.rng.seed(sampling.seed + 1);
+    std::vector<float> p(dVocab), q(draftTokens * dVocab);
+    std::vector<unsigned> tokens(prompt);
+    tokens.reserve(capacity);
+    for (auto token : prompt) {
+        sampler.observe(token);
+        draftSampler.observe(token);
+    }
+
+    // First token from the model alone
+    forwardHidden(draft, draftCache, prompt, draftWs);
+    forwardHidden(model, cache, prompt, ws);
+    auto last = ws.hidden.data.get() + (prompt.size() - 1) * model.dModel;
+    auto token = nextToken(model, sampler, last, ws);
+    sampler.observe(token);
+    draftSampler.observe(token);
+    tokens.push_back(token);
+    stats.timeToFirstToken = timer.elapsed();
+    onToken(token);
+
+    auto generated = 1u;
+    while (generated < maxNewTokens && !stopTokens.contains(tokens.back())) {
+        timer = Stopwatch();
+        auto start = tokens.size();  // tokens[start - 1] is in neither cache
+        auto nDraft = std::min(draftTokens, maxNewTokens - generated - 1);
+        auto seen = draftSampler.seen.size();
+        for (auto i = 0u; i < nDraft; ++i) {
+            auto logits = forward(draft, draftCache, std::span(tokens).subspan(draftCache.length),
+                                  draftWs);
+            draftSampler.distribution(logits, dVocab, q.data() + i * dVocab);
+            tokens.push_back(draftSampler.draw(q.data() + i * dVocab, dVocab));
+            draftSampler.observe(tokens.back());
+        }
+        auto logits = forward(model, cache, std::span(tokens).subspan(start - 1), ws, nDraft + 1);
+
+        // Accept a prefix of the draft, then add a resampled or extra token
+        auto accepted = 0u;
+        for (; accepted < nDraft; ++accepted) {
+            auto x = tokens[start + accepted];
+            auto qi = q.data() + accepted * dVocab;
+            sampler.distribution(logits + accepted * dVocab, dVocab, p.data());
+            auto u = std::uniform_real_distribution<float>(0, 1)(sampler.rng);
+            if (u * qi[x] >= p[x]) break;
+            sampler.observe(x);
+        }
+        tokens.resize(start + accepted);
+        if (accepted < nDraft) {
+            auto qi = q.data() + accepted * dVocab;
+            auto residual = 0.0f;
+            for (auto i = 0u; i < dVocab; ++i) residual += p[i] = std::max(0.0f, p[i] - qi[i]);
+            if (residual <= 0) sampler.distribution(logits + accepted * dVocab, dVocab, p.data());
+            tokens.push_back(sampler.draw(p.data(), dVocab));
+        } else {
+            // As generate() samples, so that draftTokens=0 reproduces it
+            tokens.push_back(sampler.sample(logits + nDraft * dVocab, dVocab));
+        }
+        sampler.observe(tokens.back());
+        cache.truncate(tokens.size() - 1);
+        draftCache.truncate(tokens.size() - 1);
+        draftSampler.truncateSeen(seen);
+        for (auto i = start; i < tokens.size(); ++i) draftSampler.observe(tokens[i]);
+        stats.drafted += nDraft;
+        stats.accepted += accepted;
+
+        // Emit the new tokens, up to any stop token
+        auto latency = timer.elapsed() / (tokens.size() - start);
+        for (auto i = start; i < tokens.size(); ++i) {
+            ++generated;
+            stats.tokenLatency.push_back(latency);
+            onToken(tokens[i]);
+            if (stopTokens.contains(tokens[i])) {
+                tokens.resize(i + 1);
+                break;
+            }
+        }
+    }
+    return stats;
+}
+
+// A request being served by BatchEngine
+struct BatchSequence {
+    unsigned id;
+    std::vector<unsigned> tokens;  // prompt, then generated
+    unsigned promptLength;
+    KVCache cache;         // for a prefix of tokens
+    unsigned blockBudget;  // blocks reserved for cache, at most, once admitted
+    Sampler sampler;
+
+    BatchSequence(const Model& model,
+                  std::shared_ptr<KVPool> pool,
+                  unsigned id,
+                  std::vector<unsigned> prompt,
+                  unsigned maxNewTokens,
+                  const SamplerSettings& sampling)
+        : id(id),
+          tokens(std::move(prompt)),
+          promptLength(tokens.size()),
+          cache(std::move(pool)),
+          blockBudget(0),
+          sampler(sampling, model.dVocab) {
+        tokens.reserve(promptLength + maxNewTokens);
+        cache.blocks.reserve(kvBlocksFor(promptLength + maxNewTokens));
+        sampler.seen.reserve(promptLength + maxNewTokens);
+        for (auto token : tokens) sampler.observe(token);
+    }
+
+    unsigned generated() const { return tokens.size() - promptLength; }
+
+    // Tokens not yet in the cache, to run in the next step
+    std::span<const unsigned> pending() const {
+        return std::span(tokens).subspan(cache.length);
+    }
+};
+
+struct BatchSettings {
+    unsigned maxBatch = 8;       // sequences in each forward pass
+    unsigned maxStepTokens = 0;  // positions in each forward pass (at least maxBatch)
+    unsigned kvBlocks = 0;       // KV cache pool size
+    unsigned prefixBlocks = 0;   // of the pool, for the prefix cache (0 to disable)
+    unsigned maxNewTokens = 64;
+    std::set<unsigned> stopTokens;
+    SamplerSettings sampling;
+};
+
+struct BatchStats {
+    unsigned steps = 0;
+    size_t positions = 0;        // summed over steps, prompt & generated
+    size_t cachedPositions = 0;  // prompt positions found in the prefix cache
+    size_t generated = 0;
+    unsigned peakBlocks = 0;
+    double elapsed = 0;
+    double maxStepTime = 0;
+};
+
+// Continuous batching: each step() runs one forward pass over every active sequence (a new
+// sequence's prompt, then one token at a time), so each weight row is read from memory once per
+// step for the whole batch, rather than once per sequence. Sequences leave as they finish, and
+// queued requests join, between steps. Each request is sampled as by generate()
+// Prompts are prefilled in chunks, so that each step runs at most maxStepTokens positions: every
+// active sequence gets one position (a decode step, or a prefill chunk of one), and the rest of
+// the budget goes to prefill chunks, oldest sequence first. This bounds the step time, so long
+// prompts don't stall generations in flight
+// KV caches are paged from one pool of `kvBlocks` blocks. A request joins only once the pool can
+// hold its prompt and maxNewTokens, counting blocks still reserved by active sequences, so that
+// running sequences never run out; blocks return to the pool as soon as a sequence finishes
+// With a prefix cache, a request starts from the longest cached prefix of its prompt, and adds its
+// prompt to the cache once computed (evicting cached prefixes when memory is needed)
+struct BatchEngine {
+    const Model& model;
+    BatchSettings settings;
+    std::shared_ptr<KVPool> pool;
+    std::unique_ptr<PrefixCache> prefixCache;
+    Workspace ws;
+    std::deque<std::unique_ptr<BatchSequence>> queue;
+    std::vector<std::unique_ptr<BatchSequence>> active;
+    std::vector<Segment> segments;
+    BatchStats stats;
+
+    BatchEngine(const Model& model, const BatchSettings& settings)
+        : model(model),
+          settings(settings),
+          pool(std::make_shared<KVPool>(model, settings.kvBlocks, settings.kvBlocks)),
+          ws(model, std::max(settings.maxStepTokens, settings.maxBatch), settings.maxBatch) {
+        if (settings.prefixBlocks) {
+            prefixCache = std::make_unique<PrefixCache>(pool, settings.prefixBlocks);
+        }
+        active.reserve(settings.maxBatch);
+        segments.reserve(settings.maxBatch);
+    }
+
+    void submit(unsigned id, std::vector<unsigned> prompt) {
+        auto maxNewTokens = settings.maxNewTokens;
+        if (prompt.empty()) {
+            throw std::invalid_argument("Batch prompt must not be empty");
+        }
+        if (kvBlocksFor(prompt.size() + maxNewTokens) > pool->maxBlocks) {
+            throw std::invalid_argument(std::format(
+                "Batch prompt of {} tokens (+ {} new) exceeds the KV cache pool of {} blocks",
+                prompt.size(), maxNewTokens, pool->maxBlocks));
+        }
+        if (maxNewTokens) {
+            queue.push_back(std::make_unique<BatchSequence>(model, pool, id, std::move(prompt),
+                                                            maxNewTokens, settings.sampling));
+        }
+    }
+
+    bool busy() const { return !active.empty() || !queue.empty(); }
+
+    // Admit queued requests while they fit, run one forward pass, and sample a token for each
+    // active sequence whose prompt is complete, calling onToken(id, token)
+    void step(const std::function<void(unsigned, unsigned)>& onToken) {
+        auto timer = Stopwatch();
+        auto reserved = 0u;  // blocks active sequences may still take
+        for (auto& sequence : active) {
+            reserved += sequence->blockBudget - sequence->cache.blocks.size();
+        }
+        while (!queue.empty() && active.size() < settings.maxBatch) {
+            auto& sequence = *queue.front();
+            if (prefixCache && !sequence.cache.length) {
+                sequence.cache = prefixCache->lookup(sequence.tokens, sequence.tokens.size() - 1);
+            }
+            auto pending = sequence.pending().size();
+            auto needed = sequence.cache.blocksNeeded(pending + settings.maxNewTokens - 1);
+            if (prefixCache) prefixCache->evictFor(reserved + needed);
+            if (reserved + needed > pool->available()) break;
+            reserved += needed;
+            stats.cachedPositions += sequence.cache.length;
+            sequence.blockBudget = sequence.cache.blocks.size() + needed;
+            ropeTable(model, sequence.tokens.size() + settings.maxNewTokens);
+            active.push_back(std::move(queue.front()));
+            queue.pop_front();
+        }
+        if (active.empty()) return;
+
+        segments.clear();
+        auto positions = static_cast<unsigned>(active.size());
+        for (auto& sequence : active) {
+            auto pending = sequence->pending();
+            auto n = std::min<size_t>(pending.size(), 1 + ws.maxSeq - positions);
+            positions += n - 1;
+            // Only sample once the whole prompt is in the cache
+            segments.push_back({&sequence->cache, pending.first(n), n == pending.size()});
+        }
+        auto logits = forward(model, segments, ws);
+        stats.peakBlocks = std::max(stats.peakBlocks, pool->used());
+        auto sampled = 0u;
+        for (auto i = 0u; i < active.size(); ++i) {
+            auto& sequence = *active[i];
+            if (!segments[i].logits) continue;           // mid-prefill
+            if (prefixCache && !sequence.generated()) {  // prefill just finished
+                prefixCache->insert(std::span(sequence.tokens).first(sequence.promptLength),
+                                    sequence.cache);
+            }
+            auto token = sequence.sampler.sample(logits + sampled++ * model.dVocab, model.dVocab);
+            sequence.sampler.observe(token);
+            sequence.tokens.push_back(token);
+            onToken(sequence.id, token);
+        }
+        std::erase_if(active, [this](const std::unique_ptr<BatchSequence>& sequence) {
+            return sequence->generated() &&
+                   (sequence->generated() == settings.maxNewTokens ||
+                    settings.stopTokens.contains(sequence->tokens.back()));
+        });
+        auto elapsed = timer.elapsed();
+        ++stats.steps;
+        stats.positions += positions;
+        stats.generated += sampled;
+        stats.elapsed += elapsed;
+        stats.maxStepTime = std::max(stats.maxStepTime, elapsed);
+    }
+};
+
+std::ostream& operator<<(std::ostream& out, const BatchStats& stats) {
+    return out << std::format(
+               "{} tokens generated in {:.2f} s ({:.1f} tokens/s), {} steps, mean {:.1f} "
+               "positions/step, max step {:.1f} ms, {} prompt positions cached, peak {} KV cache "
+               "blocks",
+               stats.generated, stats.elapsed,
+               stats.elapsed > 0 ? stats.generated / stats.elapsed : 0.0, stats.steps,
+               static_cast<double>(stats.positions) / std::max(stats.steps, 1u),
+               1000 * stats.maxStepTime, stats.cachedPositions, stats.peakBlocks);
+}
+
+}  // namespace lp
+
+///////////////////////////////////////////////////////////////////////////////
+// Driver program
+
+// Command line: positional arguments, and "--name" or "--name=value" options
+struct Arguments {
+    std::vector<std::string> positional;
+    std::map<std::string, std::string> options;
+
+    Arguments(int argc, char** argv) {
+        for (auto i = 1; i < argc; ++i) {
+            std::string arg(argv[i]);
+            if (arg.starts_with("--")) {
+                auto split = arg.find('=');
+                if (split == std::string::npos) {
+                    options[arg.substr(2)] = "";
+                } else {
+                    options[arg.substr(2, split - 2)] = arg.substr(split + 1);
+                }
+            } else {
+                positional.push_back(arg);
+            }
+        }
+    }
+
+    bool has(const std::string& name) const { return options.contains(name); }
+
+    std::string get(const std::string& name, const std::string& defaultValue) const {
+        auto it = options.find(name);
+        return it == options.end() ? defaultValue : it->second;
+    }
+};
+
+std::vector<unsigned> parseTokens(const std::string& text, char separator = ' ') {
+    std::vector<unsigned> tokens;
+    std::istringstream in(text);
+    std::string item;
+    while (std::getline(in, item, separator)) {
+        if (!item.empty()) tokens.push_back(std::stoul(item));
+    }
+    return tokens;
+}
+
+int main(int argc, char** argv) {
+    Arguments args(argc, argv);
+    if (args.positional.size() < 2) {
+        throw std::runtime_error(
+            "Not enough arguments."
+            " Usage: ./model path/to/config.json path/to/model.safetensors [--no-mmap]"
+            " [--kernels=avx512bf16|avx512f|avx2|scalar] [--threads=N] [--numa]"
+            " [--quantize=int8|q4 [--q4-group=32|64] [--q4-offset] [--check-quantization]]"
+            " [--generate [--max-new-tokens=N] [--stop=ID,ID,...]"
+            " [--batch=N [--kv-blocks=N] [--step-tokens=N]]]"
+            " [--prefix-cache-mb=N] [--kv-cache=fp32|int8]"
+            " [--draft=path/to/config.json,path/to/model.safetensors [--draft-tokens=K]]"
+            " [--temperature=T [--top-k=K] [--top-p=P] [--min-p=P] [--seed=N]]"
+            " [--repetition-penalty=R] [--presence-penalty=P]");
+    }
+
+    if (args.has("threads") || args.has("numa")) {
+        auto threads = std::to_string(std::thread::hardware_concurrency());
+        lp::setThreads(std::stoul(args.get("threads", threads)), args.has("numa"));
+    }
+
+    auto load = [&args](const std::string& configPath, const std::string& parametersPath) {
+        std::ifstream configFile(configPath);
+        auto model = lp::loadConfig(configFile);
+        if (args.has("kernels")) {
+            model.kernels = lp::selectKernels(args.get("kernels", ""));
+        }
+        if (args.has("no-mmap")) {
+            std::ifstream dataFile(parametersPath, std::ios::binary);
+            lp::loadParameters(model, dataFile);
+        } else {
+            lp::mapParameters(model, parametersPath);
+        }
+        return model;
+    };
+    auto model = load(args.positional[0], args.positional[1]);
+
+    lp::QuantizationSettings quantization;
+    if (args.has("quantize")) {
+        auto format = args.get("quantize", "");
+        if (format == "int8") {
+            quantization.dtype = lp::DType::I8;
+        } else if (format == "q4") {
+            quantization.dtype = lp::DType::Q4;
+            quantization.groupSize = std::stoul(args.get("q4-group", "32"));
+            quantization.useOffset = args.has("q4-offset");
+        } else {
+            throw std::invalid_argument(std::format("Unknown --quantize format \"{}\"", format));
+        }
+    }
+    auto kvFormat = args.get("kv-cache", "fp32");
+    if (kvFormat == "int8") {
+        model.kvDType = lp::KVDType::I8;
+    } else if (kvFormat != "fp32") {
+        throw std::invalid_argument(std::format("Unknown --kv-cache format \"{}\"", kvFormat));
+    }
+    auto checkQuantization = args.has("check-quantization");
+    auto error = lp::quantizeParameters(model, quantization, checkQuantization);
+    std::unique_ptr<lp::Model> reference;
+    if (checkQuantization) {
+        std::cerr << std::format("Max weight relative error {:.4f}", error) << std::endl;
+        reference = std::make_unique<lp::Model>(load(args.positional[0], args.positional[1]));
+    }
+
+    // Speculative decoding, with a draft model that shares the quantization & KV cache settings
+    std::unique_ptr<lp::Model> draft;
+    auto draftTokens = std::stoul(args.get("draft-tokens", "4"));
+    if (args.has("draft")) {
+        for (auto option : {"batch", "prefix-cache-mb", "check-quantization"}) {
+            if (args.has(option)) {
+                throw std::invalid_argument(
+                    std::format("--draft is not supported with --{}", option));
+            }
+        }
+        if (!args.has("generate")) {
+            throw std::invalid_argument("--draft requires --generate");
+        }
+        auto paths = args.get("draft", "");
+        auto split = paths.find(',');
+        if (split == std::string::npos) {
+            throw std::invalid_argument(
+                "--draft expects path/to/config.json,path/to/model.safetensors");
+        }
+        draft = std::make_unique<lp::Model>(load(paths.substr(0, split), paths.substr(split + 1)));
+        draft->kvDType = model.kvDType;
+        lp::quantizeParameters(*draft, quantization, false);
+    }
+    if (args.has("numa")) {
+        lp::placeProjections(model);
+        if (draft) lp::placeProjections(*draft);
+        std::cerr << std::format("NUMA: {} node(s), {} threads, projections split by output rows",
+                                 lp::numaNodes().size(), lp::threadPool().size())
+                  << std::endl;
+    }
+    std::cerr << lp::memoryReport() << std::endl;
+
+    lp::SamplerSettings sampling;
+    sampling.temperature = std::stof(args.get("temperature", "0"));
+    sampling.topK = std::stoul(args.get("top-k", "0"));
+    sampling.topP = std::stof(args.get("top-p", "1"));
+    sampling.minP = std::stof(args.get("min-p", "0"));
+    sampling.repetitionPenalty = std::stof(args.get("repetition-penalty", "1"));
+    sampling.presencePenalty = std::stof(args.get("presence-penalty", "0"));
+    sampling.seed = std::stoull(args.get("seed", "0"));
+
+    auto maxNewTokens = std::stoul(args.get("max-new-tokens", "64"));
+    auto stopTokens = model.eosTokens;
+    if (args.has("stop")) {
+        auto tokens = parseTokens(args.get("stop", ""), ',');
+        stopTokens = std::set<unsigned>(tokens.begin(), tokens.end());
+    }
+
+    // Cache prompt prefixes across requests, in a memory budget (MiB)
+    auto prefixBlocks = static_cast<unsigned>(std::stod(args.get("prefix-cache-mb", "0")) *
+                                              (1 << 20) / lp::kvBlockBytes(model));
+
+    // Each line of stdin is a prompt of space-separated token IDs
+    std::string line;
+    if (args.has("generate") && args.has("batch") && !reference) {
+        // Serve all prompts concurrently, printing generations in prompt order at the end
+        std::vector<std::vector<unsigned>> prompts;
+        auto longest = 0ul;
+        while (std::getline(std::cin, line)) {
+            prompts.push_back(parseTokens(line));
+            longest = std::max(longest, prompts.back().size());
+        }
+        lp::BatchSettings settings;
+        settings.maxBatch = std::stoul(args.get("batch", "8"));
+        // By default, prefill prompts in chunks of up to 256 positions per step
+        settings.maxStepTokens = std::stoul(args.get("step-tokens", "256"));
+        // By default, enough KV cache blocks that the longest prompts never wait for memory
+        auto kvBlocks = settings.maxBatch * lp::kvBlocksFor(longest + maxNewTokens) + prefixBlocks;
+        settings.kvBlocks = std::stoul(args.get("kv-blocks", std::to_string(kvBlocks)));
+        settings.prefixBlocks = prefixBlocks;
+        settings.maxNewTokens = maxNewTokens;
+        settings.stopTokens = stopTokens;
+        settings.sampling = sampling;
+        lp::BatchEngine engine(model, settings);
+        for (auto i = 0u; i < prompts.size(); ++i) {
+            // A bad request gets an empty output line, without stopping the others
+            try {
+                engine.submit(i, std::move(prompts[i]));
+            } catch (const std::invalid_argument& error) {
+                std::cerr << std::format("Skipping prompt {}: {}", i + 1, error.what())
+                          << std::endl;
+            }
+        }
+        std::vector<std::vector<unsigned>> outputs(prompts.size());
+        while (engine.busy()) {
+            engine.step([&outputs](unsigned id, unsigned token) { outputs[id].push_back(token); });
+        }
+        for (auto& output : outputs) {
+            for (auto token : output) std::cout << token << " ";
+            std::cout << std::endl;
+        }
+        std::cerr << engine.stats << std::endl;
+        return 0;
+    }
+    std::unique_ptr<lp::PrefixCache> prefixCache;
+    if (prefixBlocks) {
+        prefixCache = std::make_unique<lp::PrefixCache>(std::make_shared<lp::KVPool>(model, 1),
+                                                        prefixBlocks);
+    }
+    while (std::getline(std::cin, line)) {
+        auto tokens = parseTokens(line);
+        if (tokens.empty()) {
+            // Keep one output line per input line
+            std::cout << std::endl;
+            std::cerr << "Skipping empty prompt" << std::endl;
+        } else if (reference) {
+            lp::checkAgainstReference(*reference, model, tokens);
+        } else if (args.has("generate")) {
+            auto onToken = [](unsigned token) { std::cout << token << " " << std::flush; };
+            auto stats = draft ? lp::generateSpeculative(model, *draft, draftTokens, tokens,
+                                                         maxNewTokens, stopTokens, sampling,
+                                                         onToken)
+                               : lp::generate(model, tokens, maxNewTokens, stopTokens, sampling,
+                                              onToken, prefixCache.get());
+            std::cout << std::endl;
+            std::cerr << stats << std::endl;
+        } else {
+            lp::predict(model, tokens, sampling, prefixCache.get());
+        }
     }
 
     return 0;